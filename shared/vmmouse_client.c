@@ -41,12 +41,46 @@
 #include "vmmouse_client.h"
 #include "vmmouse_proto.h"
 
+/*
+ * Maximum number of packets moved per high-bandwidth transfer.
+ */
+#define VMMOUSE_CLIENT_BULK_PACKETS 128
+
+/*
+ * Whether high-bandwidth transfers of the data queue are tried. No
+ * known host implements them for ABSPOINTER_DATA, so they are only
+ * used when requested through VMMouseClient_SetBulk. Cleared on the
+ * first failed transfer, re-armed on enable.
+ */
+static bool vmmouseBulkRequested;
+static bool vmmouseBulkAvailable;
+
+/*
+ * Packets returned to callers since startup.
+ */
+static uint64_t vmmousePackets;
+
+/*
+ * Queue words discarded to realign on a packet boundary.
+ */
+static uint64_t vmmouseWordsDiscarded;
+static uint32_t vmmouseWordsUnreported;
+
+/*
+ * Result of the GETVERSION probe, which cannot change while we run:
+ * -1 until probed, then 0 (no backdoor) or 1 (in a VM).
+ */
+static int vmmouseVMCheck = -1;
+static uint32_t vmmouseHostVersion;
+
 /*
  *----------------------------------------------------------------------------
  *
  * VMMouseClientVMCheck --
  *
  *      Checks if we're running in a VM by sending the GETVERSION command.
+ *      The command is only sent once; later calls return the cached
+ *      result.
  *
  * Returns:
  *      0 if we're running natively/the version command failed,
@@ -60,6 +94,9 @@ VMMouseClientVMCheck(void)
 {
    VMMouseProtoCmd vmpc;
 
+   if (vmmouseVMCheck >= 0)
+      return vmmouseVMCheck;
+
    vmpc.in.vEbx = ~VMMOUSE_PROTO_MAGIC;
    vmpc.in.command = VMMOUSE_PROTO_CMD_GETVERSION;
    VMMouseProto_SendCmd(&vmpc);
@@ -69,9 +106,38 @@ VMMouseClientVMCheck(void)
     * eax should contain version
     */
    if (vmpc.out.vEbx != VMMOUSE_PROTO_MAGIC || vmpc.out.vEax == 0xffffffff) {
+      vmmouseVMCheck = 0;
       return false;
    }
 
+   vmmouseHostVersion = vmpc.out.vEax;
+   vmmouseVMCheck = 1;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseClient_Probe --
+ *
+ *      Checks for the backdoor, reusing an earlier probe if there was one.
+ *
+ * Returns:
+ *      true if we're in a VM, with the host version in *version if
+ *      version is not NULL.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+bool
+VMMouseClient_Probe(uint32_t *version)
+{
+   if (!VMMouseClientVMCheck())
+      return false;
+
+   if (version)
+      *version = vmmouseHostVersion;
    return true;
 }
 
@@ -197,6 +263,8 @@ VMMouseClient_Enable(void) {
    vmpc.in.command = VMMOUSE_PROTO_CMD_ABSPOINTER_RESTRICT;
    VMMouseProto_SendCmd(&vmpc);
 
+   vmmouseBulkAvailable = vmmouseBulkRequested;
+
    /*
     * To quote Jeremy, "Go Go Go!"
     */
@@ -209,58 +277,143 @@ VMMouseClient_Enable(void) {
 /*
  *----------------------------------------------------------------------
  *
- * VMMouseClient_GetInput --
+ * VMMouseClientGetStatus --
  *
- *	Retrieves a 4-word input packet from the VMMouse data port and
- *	stores it in the specified input structure.
+ *	Queries the host for the VMMouse status dword. The high 16 bits
+ *	are flags, the low 16 bits are the number of DWORDs waiting in
+ *	the data queue. VMMOUSE_ERROR is a special case that indicates
+ *	there's something wrong on the host end, e.g. the VMMouse was
+ *	disabled on the host-side.
  *
  * Results:
- *	The number of packets in the queue, including the retrieved
- *	packet.
+ *	The number of queued DWORDs, or VMMOUSE_ERROR.
  *
  * Side effects:
- *	Could cause host state change.
+ *	None.
  *
  *----------------------------------------------------------------------
  */
 
-unsigned int
-VMMouseClient_GetInput (PVMMOUSE_INPUT_DATA pvmmouseInput) {
-
+static uint32_t
+VMMouseClientGetStatus(void)
+{
    uint32_t status;
-   uint16_t numWords;
-   uint32_t packetInfo;
    VMMouseProtoCmd vmpc;
 
-   /*
-    * The status dword has two parts: the high 16 bits are
-    * for flags, the low 16-bits are the number of DWORDs
-    * waiting in the data queue. VMMOUSE_ERROR is a special
-    * case that indicates there's something wrong on the
-    * host end, e.g. the VMMouse was disabled on the host-side.
-    */
    vmpc.in.vEbx = 0;
    vmpc.in.command = VMMOUSE_PROTO_CMD_ABSPOINTER_STATUS;
    VMMouseProto_SendCmd(&vmpc);
    status = vmpc.out.vEax;
    if ((status & VMMOUSE_ERROR) == VMMOUSE_ERROR) {
-      VMwareLog(("VMMouseClient_GetInput: VMMOUSE_ERROR status, abort!\n"));
       return VMMOUSE_ERROR;
    }
 
    /*
     * We don't use the status flags, just get the words
     */
-   numWords = status & 0x0000ffff;
+   return status & 0x0000ffff;
+}
 
-   if ((numWords % 4) != 0) {
-      VMwareLog(("VMMouseClient_GetInput: invalid status numWords, abort!\n"));
-      return (0);
-   }
 
-   if (numWords == 0) {
-      return (0);
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseClientResync --
+ *
+ *	Realigns the host data queue on a packet boundary when the
+ *	status reports a word count that is not a multiple of 4. Where
+ *	the partial packet sits is not known, so the whole backlog the
+ *	status reported is read and thrown away, 4 words per request.
+ *	The host appends whole packets, so whatever arrives afterwards
+ *	starts on a boundary; if the partial packet was still being
+ *	completed at the tail, the next status is misaligned again and
+ *	the rest of it is discarded then. No misaligned packet is ever
+ *	decoded.
+ *
+ * Results:
+ *	0, the number of queued DWORDs left.
+ *
+ * Side effects:
+ *	Dequeues numWords words on the host.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint32_t
+VMMouseClientResync(uint32_t numWords)
+{
+   VMMouseProtoCmd vmpc;
+   uint32_t left = numWords;
+   uint32_t chunk;
+
+   /* in and out share storage, so the request is rebuilt each time. */
+   while (left) {
+      chunk = left < 4 ? left : 4;
+      vmpc.in.vEbx = chunk;
+      vmpc.in.command = VMMOUSE_PROTO_CMD_ABSPOINTER_DATA;
+      VMMouseProto_SendCmd(&vmpc);
+      left -= chunk;
    }
+   vmmouseWordsDiscarded += numWords;
+   vmmouseWordsUnreported += numWords;
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseClientDecodePacket --
+ *
+ *	Unpacks the four dwords of a VMMouse packet into the specified
+ *	input structure.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseClientDecodePacket(PVMMOUSE_INPUT_DATA pvmmouseInput,
+                          uint32_t packetInfo, uint32_t x, uint32_t y,
+                          uint32_t z)
+{
+   pvmmouseInput->Flags = (packetInfo & 0xffff0000) >> 16;
+   pvmmouseInput->Buttons = (packetInfo & 0x0000ffff);
+
+   /* Note that Z is always signed, and X/Y are signed in relative mode. */
+   pvmmouseInput->X = (int)x;
+   pvmmouseInput->Y = (int)y;
+   pvmmouseInput->Z = (int)z;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseClientReadPacket --
+ *
+ *	Retrieves a single 4-word input packet from the VMMouse data port
+ *	and stores it in the specified input structure. The caller must
+ *	have checked that a full packet is queued.
+ *
+ * Results:
+ *	None.
+ *
+ * Side effects:
+ *	Dequeues one packet on the host.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseClientReadPacket(PVMMOUSE_INPUT_DATA pvmmouseInput)
+{
+   VMMouseProtoCmd vmpc;
 
    /*
     * The VMMouse uses a 4-dword packet protocol:
@@ -273,14 +426,109 @@ VMMouseClient_GetInput (PVMMOUSE_INPUT_DATA pvmmouseInput) {
    vmpc.in.vEbx = 4;
    vmpc.in.command = VMMOUSE_PROTO_CMD_ABSPOINTER_DATA;
    VMMouseProto_SendCmd(&vmpc);
-   packetInfo = vmpc.out.vEax;
-   pvmmouseInput->Flags = (packetInfo & 0xffff0000) >> 16;
-   pvmmouseInput->Buttons = (packetInfo & 0x0000ffff);
+   VMMouseClientDecodePacket(pvmmouseInput, vmpc.out.vEax, vmpc.out.vEbx,
+                             vmpc.out.vEcx, vmpc.out.vEdx);
+}
 
-   /* Note that Z is always signed, and X/Y are signed in relative mode. */
-   pvmmouseInput->X = (int)vmpc.out.vEbx;
-   pvmmouseInput->Y = (int)vmpc.out.vEcx;
-   pvmmouseInput->Z = (int)vmpc.out.vEdx;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseClientReadPacketsBulk --
+ *
+ *	Retrieves numPackets queued 4-word packets through the
+ *	high-bandwidth port, one transfer per VMMOUSE_CLIENT_BULK_PACKETS.
+ *
+ * Results:
+ *	The number of packets stored in pvmmouseInput. This is less than
+ *	numPackets if the host doesn't support bulk transfers, in which
+ *	case they are not attempted again until the next enable. A
+ *	failed transfer may still have dequeued some words; the caller
+ *	must query the status again before reading on.
+ *
+ * Side effects:
+ *	Dequeues the retrieved packets on the host.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+VMMouseClientReadPacketsBulk(PVMMOUSE_INPUT_DATA pvmmouseInput,
+                             unsigned int numPackets)
+{
+   uint32_t data[VMMOUSE_CLIENT_BULK_PACKETS * 4];
+   unsigned int done = 0;
+   unsigned int chunk;
+   uint32_t words;
+   unsigned int i;
+
+   while (done < numPackets) {
+      chunk = numPackets - done;
+      if (chunk > VMMOUSE_CLIENT_BULK_PACKETS) {
+         chunk = VMMOUSE_CLIENT_BULK_PACKETS;
+      }
+
+      words = VMMouseProto_ReadBulk(VMMOUSE_PROTO_CMD_ABSPOINTER_DATA,
+                                    data, chunk * 4);
+
+      /* Keep the complete packets of a short transfer. */
+      for (i = 0; i < words / 4; i++) {
+         VMMouseClientDecodePacket(&pvmmouseInput[done + i],
+                                   data[i * 4], data[i * 4 + 1],
+                                   data[i * 4 + 2], data[i * 4 + 3]);
+      }
+      done += words / 4;
+
+      if (words != chunk * 4) {
+         VMwareLog(("VMMouseClient: bulk transfer unsupported, falling back\n"));
+         vmmouseBulkAvailable = false;
+         break;
+      }
+   }
+
+   return done;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseClient_GetInput --
+ *
+ *	Retrieves a 4-word input packet from the VMMouse data port and
+ *	stores it in the specified input structure.
+ *
+ * Results:
+ *	The number of packets in the queue, including the retrieved
+ *	packet.
+ *
+ * Side effects:
+ *	Could cause host state change.
+ *
+ *----------------------------------------------------------------------
+ */
+
+unsigned int
+VMMouseClient_GetInput (PVMMOUSE_INPUT_DATA pvmmouseInput) {
+
+   uint32_t numWords;
+
+   numWords = VMMouseClientGetStatus();
+   if (numWords == VMMOUSE_ERROR) {
+      VMwareLog(("VMMouseClient_GetInput: VMMOUSE_ERROR status, abort!\n"));
+      return VMMOUSE_ERROR;
+   }
+
+   if ((numWords % 4) != 0) {
+      numWords = VMMouseClientResync(numWords);
+   }
+
+   if (numWords == 0) {
+      return (0);
+   }
+
+   VMMouseClientReadPacket(pvmmouseInput);
+   vmmousePackets++;
 
    /*
     * Return number of packets (including this one) in queue.
@@ -289,6 +537,151 @@ VMMouseClient_GetInput (PVMMOUSE_INPUT_DATA pvmmouseInput) {
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseClientReadBatch --
+ *
+ *	Reads up to maxPackets queued packets after a single status
+ *	query, through the high-bandwidth port when the host supports
+ *	it and one backdoor call per packet otherwise.
+ *
+ * Results:
+ *	The number of packets stored in pvmmouseInput, or VMMOUSE_ERROR.
+ *
+ * Side effects:
+ *	Could cause host state change.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+VMMouseClientReadBatch(PVMMOUSE_INPUT_DATA pvmmouseInput,
+                       unsigned int maxPackets)
+{
+   uint32_t numWords;
+   unsigned int numPackets;
+   unsigned int i;
+
+   numWords = VMMouseClientGetStatus();
+   if (numWords == VMMOUSE_ERROR) {
+      VMwareLog(("VMMouseClient_GetInputBatch: VMMOUSE_ERROR status, abort!\n"));
+      return VMMOUSE_ERROR;
+   }
+
+   if ((numWords % 4) != 0) {
+      numWords = VMMouseClientResync(numWords);
+   }
+
+   numPackets = numWords >> 2;
+   if (numPackets > maxPackets) {
+      numPackets = maxPackets;
+   }
+
+   i = 0;
+   if (numPackets > 1 && vmmouseBulkAvailable) {
+      i = VMMouseClientReadPacketsBulk(pvmmouseInput, numPackets);
+      if (i < numPackets) {
+         /*
+          * The failed transfer may have dequeued part of the queue, so
+          * find out what is left before reading on packet by packet.
+          */
+         numWords = VMMouseClientGetStatus();
+         if (numWords == VMMOUSE_ERROR) {
+            return i ? i : VMMOUSE_ERROR;
+         }
+         if ((numWords % 4) != 0) {
+            numWords = VMMouseClientResync(numWords);
+         }
+         if (numPackets - i > numWords >> 2) {
+            numPackets = i + (numWords >> 2);
+         }
+      }
+   }
+
+   for (; i < numPackets; i++) {
+      VMMouseClientReadPacket(&pvmmouseInput[i]);
+   }
+
+   return numPackets;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseClient_GetInputBatch --
+ *
+ *	Drains up to maxPackets 4-word input packets from the VMMouse
+ *	data port into the caller-supplied array. Unlike
+ *	VMMouseClient_GetInput, the host status is only queried once
+ *	per call. A backlog of several packets is moved through the
+ *	high-bandwidth port when the host supports it; otherwise each
+ *	packet costs a single backdoor call.
+ *
+ * Results:
+ *	The number of packets stored in pvmmouseInput, or VMMOUSE_ERROR.
+ *	If the return value equals maxPackets, more packets may still be
+ *	queued on the host.
+ *
+ * Side effects:
+ *	Could cause host state change.
+ *
+ *----------------------------------------------------------------------
+ */
+
+unsigned int
+VMMouseClient_GetInputBatch(PVMMOUSE_INPUT_DATA pvmmouseInput,
+                            unsigned int maxPackets)
+{
+   unsigned int numPackets;
+
+   numPackets = VMMouseClientReadBatch(pvmmouseInput, maxPackets);
+   if (numPackets != VMMOUSE_ERROR) {
+      vmmousePackets += numPackets;
+   }
+   return numPackets;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseClient_Flush --
+ *
+ *	Discards everything queued on the host, for a device that was
+ *	left enabled while nobody was reading it. Much cheaper than the
+ *	disable and READ_ID handshake when the queue is short.
+ *
+ * Results:
+ *	The number of packets discarded, or VMMOUSE_ERROR.
+ *
+ * Side effects:
+ *	Empties the host queue.
+ *
+ *----------------------------------------------------------------------
+ */
+
+unsigned int
+VMMouseClient_Flush(void)
+{
+   VMMOUSE_INPUT_DATA scratch[VMMOUSE_CLIENT_BULK_PACKETS];
+   unsigned int numPackets;
+   unsigned int total = 0;
+
+   do {
+      numPackets = VMMouseClientReadBatch(scratch,
+                                          VMMOUSE_CLIENT_BULK_PACKETS);
+      if (numPackets == VMMOUSE_ERROR) {
+         return VMMOUSE_ERROR;
+      }
+      total += numPackets;
+   } while (numPackets == VMMOUSE_CLIENT_BULK_PACKETS);
+
+   return total;
+}
+
+
 /*
  *----------------------------------------------------------------------------
  *
@@ -347,3 +740,162 @@ VMMouseClient_RequestAbsolute(void)
    vmpc.in.command = VMMOUSE_PROTO_CMD_ABSPOINTER_COMMAND;
    VMMouseProto_SendCmd(&vmpc);
 }
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseClient_SetBulk --
+ *
+ *      Allow or forbid high-bandwidth transfers of the data queue. They
+ *      are off by default; when allowed, the first failed transfer
+ *      turns them off again until the next enable.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+VMMouseClient_SetBulk(bool enable)
+{
+   vmmouseBulkRequested = enable;
+   vmmouseBulkAvailable = enable;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseClient_Coalesce --
+ *
+ *      Merges runs of motion-only packets in place. A run of absolute
+ *      packets collapses to its last position, a run of relative packets
+ *      to the sum of its deltas. A packet that changes the buttons keeps
+ *      its own position, so a press or release is posted where it
+ *      happened; only the motion after it is merged. Absolute/relative
+ *      flips and wheel movement also end a run.
+ *
+ *      The buttons before the first packet are not known here, so the
+ *      first packet is treated as a transition.
+ *
+ * Results:
+ *      The number of packets left in the array.
+ *
+ * Side effects:
+ *      pvmmouseInput is rewritten.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+unsigned int
+VMMouseClient_Coalesce(PVMMOUSE_INPUT_DATA pvmmouseInput,
+                       unsigned int numPackets)
+{
+   unsigned int i, out = 0;
+   unsigned short lastButtons = 0;
+   bool open = false;           /* pvmmouseInput[out - 1] may absorb motion */
+
+   for (i = 0; i < numPackets; i++) {
+      PVMMOUSE_INPUT_DATA cur = &pvmmouseInput[i];
+      unsigned short buttons = cur->Buttons;
+
+      if (open) {
+         PVMMOUSE_INPUT_DATA prev = &pvmmouseInput[out - 1];
+
+         if (prev->Buttons == buttons &&
+             (prev->Flags & VMMOUSE_MOVE_RELATIVE) ==
+             (cur->Flags & VMMOUSE_MOVE_RELATIVE) &&
+             cur->Z == 0) {
+            if (cur->Flags & VMMOUSE_MOVE_RELATIVE) {
+               prev->X += cur->X;
+               prev->Y += cur->Y;
+            } else {
+               prev->X = cur->X;
+               prev->Y = cur->Y;
+            }
+            continue;
+         }
+      }
+
+      open = i > 0 && buttons == lastButtons && cur->Z == 0;
+      lastButtons = buttons;
+      pvmmouseInput[out++] = *cur;
+   }
+
+   return out;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseClient_TakeDiscarded --
+ *
+ *      Report the words dropped on resync since the last call, so the
+ *      caller can log each resync in its own way.
+ *
+ * Results:
+ *      The number of words discarded since the last call.
+ *
+ * Side effects:
+ *      Resets the count.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint32_t
+VMMouseClient_TakeDiscarded(void)
+{
+   uint32_t words = vmmouseWordsUnreported;
+
+   vmmouseWordsUnreported = 0;
+   return words;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseClient_GetStats --
+ *
+ *      Report the backdoor cost of the packets delivered so far.
+ *
+ * Results:
+ *      Statistics returned in pStats.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+VMMouseClient_GetStats(PVMMOUSE_CLIENT_STATS pStats)
+{
+   VMMouseProtoStats protoStats;
+   int i;
+
+   VMMouseProto_GetStats(&protoStats);
+
+   pStats->Packets = vmmousePackets;
+   pStats->WordsDiscarded = vmmouseWordsDiscarded;
+   pStats->Exits = 0;
+   pStats->Cycles = 0;
+   for (i = 0; i < VMMOUSE_PROTO_STAT_MAX; i++) {
+      pStats->Exits += protoStats.calls[i];
+      pStats->Cycles += protoStats.cycles[i];
+   }
+
+   if (vmmousePackets) {
+      pStats->ExitsPerPacket = (double)pStats->Exits / vmmousePackets;
+      pStats->CyclesPerPacket = (double)pStats->Cycles / vmmousePackets;
+   } else {
+      pStats->ExitsPerPacket = 0;
+      pStats->CyclesPerPacket = 0;
+   }
+}
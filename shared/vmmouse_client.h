@@ -40,6 +40,7 @@
 #define _VMMOUSE_CLIENT_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "xorg-server.h"
 #include "xf86_OSproc.h"
@@ -55,14 +56,36 @@ typedef struct _VMMOUSE_INPUT_DATA {
    int Z;
 } VMMOUSE_INPUT_DATA, *PVMMOUSE_INPUT_DATA;
 
+/*
+ * VMMouse client statistics. Exits and cycles cover all the backdoor
+ * requests sent so far, so the ratios include the handshakes.
+ */
+typedef struct _VMMOUSE_CLIENT_STATS {
+   uint64_t Packets;            /* packets returned to the caller */
+   uint64_t WordsDiscarded;     /* words dropped on resync */
+   uint64_t Exits;              /* backdoor requests sent */
+   uint64_t Cycles;             /* TSC cycles spent in backdoor requests */
+   double ExitsPerPacket;
+   double CyclesPerPacket;
+} VMMOUSE_CLIENT_STATS, *PVMMOUSE_CLIENT_STATS;
+
 /*
  * Public Functions
  */
+bool VMMouseClient_Probe(uint32_t *version);
 bool VMMouseClient_Enable(void);
 void VMMouseClient_Disable(void);
 unsigned int VMMouseClient_GetInput(PVMMOUSE_INPUT_DATA pvmmouseInput);
+unsigned int VMMouseClient_GetInputBatch(PVMMOUSE_INPUT_DATA pvmmouseInput,
+                                         unsigned int maxPackets);
+unsigned int VMMouseClient_Flush(void);
+unsigned int VMMouseClient_Coalesce(PVMMOUSE_INPUT_DATA pvmmouseInput,
+                                    unsigned int numPackets);
+void VMMouseClient_SetBulk(bool enable);
 void VMMouseClient_RequestRelative(void);
 void VMMouseClient_RequestAbsolute(void);
+uint32_t VMMouseClient_TakeDiscarded(void);
+void VMMouseClient_GetStats(PVMMOUSE_CLIENT_STATS pStats);
 
 #ifdef VMX86_DEVEL
 #define VMwareLog(args) ErrorF args
@@ -0,0 +1,138 @@
+/*
+ * Copyright 2026 by the XLibre project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ */
+
+/*
+ * vmmouse_hypervisor.c --
+ *
+ *      CPUID based hypervisor detection. CPUID leaf 0x1 reports a
+ *      hypervisor in ECX bit 31, and leaf 0x40000000 returns the vendor
+ *      signature in EBX, ECX and EDX. Neither needs any privilege or
+ *      traps to the host, unlike a probe of the backdoor port.
+ */
+#include "config.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#if defined __i386__ || defined __x86_64__
+#include <cpuid.h>
+#endif
+
+#include "vmmouse_hypervisor.h"
+
+#define VMMOUSE_HV_CPUID_FEATURES  0x1
+#define VMMOUSE_HV_CPUID_PRESENT   (1U << 31)
+#define VMMOUSE_HV_CPUID_VENDOR    0x40000000
+#define VMMOUSE_HV_VMWARE_VENDOR   "VMwareVMware"
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseHypervisor_Detect --
+ *
+ *      Checks the CPUID hypervisor bit and vendor signature.
+ *
+ * Returns:
+ *      VMMOUSE_HV_VMWARE if running on VMware, VMMOUSE_HV_OTHER under
+ *      another hypervisor, VMMOUSE_HV_NONE otherwise.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+VMMouseHypervisor
+VMMouseHypervisor_Detect(void)
+{
+#if defined __i386__ || defined __x86_64__
+   unsigned int eax, ebx, ecx, edx;
+   char vendor[13];
+
+   if (!__get_cpuid(VMMOUSE_HV_CPUID_FEATURES, &eax, &ebx, &ecx, &edx) ||
+       !(ecx & VMMOUSE_HV_CPUID_PRESENT)) {
+      return VMMOUSE_HV_NONE;
+   }
+
+   /*
+    * The hypervisor leaves are outside the range __get_cpuid checks
+    * against, so query them directly.
+    */
+   __cpuid(VMMOUSE_HV_CPUID_VENDOR, eax, ebx, ecx, edx);
+   memcpy(vendor + 0, &ebx, 4);
+   memcpy(vendor + 4, &ecx, 4);
+   memcpy(vendor + 8, &edx, 4);
+   vendor[12] = '\0';
+
+   if (!strcmp(vendor, VMMOUSE_HV_VMWARE_VENDOR)) {
+      return VMMOUSE_HV_VMWARE;
+   }
+   return VMMOUSE_HV_OTHER;
+#else
+   return VMMOUSE_HV_NONE;
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseHypervisor_Name --
+ *
+ *      Returns a printable name for a detection result.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+const char *
+VMMouseHypervisor_Name(VMMouseHypervisor hv)
+{
+   switch (hv) {
+   case VMMOUSE_HV_VMWARE:
+      return "VMware";
+   case VMMOUSE_HV_OTHER:
+      return "another hypervisor";
+   default:
+      return "no hypervisor";
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseHypervisor_MayHaveBackdoor --
+ *
+ *      Tells whether the backdoor port is worth probing under hv. Only
+ *      VMware is assumed to have it, other hypervisors if other is set.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+bool
+VMMouseHypervisor_MayHaveBackdoor(VMMouseHypervisor hv, bool other)
+{
+   return hv == VMMOUSE_HV_VMWARE || (hv == VMMOUSE_HV_OTHER && other);
+}
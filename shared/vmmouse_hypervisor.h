@@ -0,0 +1,55 @@
+/*
+ * Copyright 2026 by the XLibre project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ */
+
+/*
+ * vmmouse_hypervisor.h --
+ *
+ *      Cheap hypervisor detection through CPUID, used to avoid touching
+ *      I/O privileges and the backdoor port outside VMware.
+ *
+ *      Other hypervisors may emulate the backdoor too: QEMU does with
+ *      its vmport device, under the KVM or TCG CPUID vendor. Probing
+ *      every hypervisor would cost all the others an iopl and a port
+ *      exit, so they are only probed when the caller opts in.
+ */
+
+#ifndef _VMMOUSE_HYPERVISOR_H_
+#define _VMMOUSE_HYPERVISOR_H_
+
+#include <stdbool.h>
+
+typedef enum {
+   VMMOUSE_HV_NONE,             /* no hypervisor bit, or not x86 */
+   VMMOUSE_HV_OTHER,            /* a hypervisor that is not VMware */
+   VMMOUSE_HV_VMWARE,
+} VMMouseHypervisor;
+
+VMMouseHypervisor VMMouseHypervisor_Detect(void);
+const char *VMMouseHypervisor_Name(VMMouseHypervisor hv);
+bool VMMouseHypervisor_MayHaveBackdoor(VMMouseHypervisor hv, bool other);
+
+#endif /* _VMMOUSE_HYPERVISOR_H_ */
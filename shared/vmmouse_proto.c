@@ -33,7 +33,15 @@
  */
 #include "config.h"
 
+#include <string.h>
+#include <strings.h>
+
 #include "vmmouse_proto.h"
+#include "vmmouse_sim.h"
+
+#ifndef VMMOUSE_DEFAULT_TRANSPORT
+#define VMMOUSE_DEFAULT_TRANSPORT "backdoor"
+#endif
 
 
 /*
@@ -120,6 +128,324 @@ VMMouseProtoInOut(VMMouseProtoCmd *cmd) // IN/OUT
 }
 
 
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseProtoInOutHB --
+ *
+ *      Send a high-bandwidth request to vmware. The host transfers ecx
+ *      dwords into the buffer pointed to by edi with a single rep insl.
+ *
+ * Results:
+ *      Host-side response returned in cmd IN/OUT parameter, data returned
+ *      in the buffer.
+ *
+ * Side effects:
+ *      Pokes the high-bandwidth communication port.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+VMMouseProtoInOutHB(VMMouseProtoCmd *cmd) // IN/OUT
+{
+#ifdef __x86_64__
+   uint64_t dummy;
+
+   __asm__ __volatile__(
+        "pushq %%rax"           "\n\t"
+        "movq 40(%%rax), %%rdi" "\n\t"
+        "movq 32(%%rax), %%rsi" "\n\t"
+        "movq 24(%%rax), %%rdx" "\n\t"
+        "movq 16(%%rax), %%rcx" "\n\t"
+        "movq  8(%%rax), %%rbx" "\n\t"
+        "movq   (%%rax), %%rax" "\n\t"
+        "cld"                   "\n\t"
+        "rep; insl"             "\n\t"
+        "xchgq %%rax, (%%rsp)"  "\n\t"
+        "movq %%rdi, 40(%%rax)" "\n\t"
+        "movq %%rsi, 32(%%rax)" "\n\t"
+        "movq %%rdx, 24(%%rax)" "\n\t"
+        "movq %%rcx, 16(%%rax)" "\n\t"
+        "movq %%rbx,  8(%%rax)" "\n\t"
+        "popq          (%%rax)"
+      : "=a" (dummy)
+      : "0" (cmd)
+      : "rbx", "rcx", "rdx", "rsi", "rdi", "cc", "memory"
+   );
+#else
+#ifdef __i386__
+   uint32_t dummy;
+
+   __asm__ __volatile__(
+        "pushl %%ebx"           "\n\t"
+        "pushl %%eax"           "\n\t"
+        "movl 20(%%eax), %%edi" "\n\t"
+        "movl 16(%%eax), %%esi" "\n\t"
+        "movl 12(%%eax), %%edx" "\n\t"
+        "movl  8(%%eax), %%ecx" "\n\t"
+        "movl  4(%%eax), %%ebx" "\n\t"
+        "movl   (%%eax), %%eax" "\n\t"
+        "cld"                   "\n\t"
+        "rep; insl"             "\n\t"
+        "xchgl %%eax, (%%esp)"  "\n\t"
+        "movl %%edi, 20(%%eax)" "\n\t"
+        "movl %%esi, 16(%%eax)" "\n\t"
+        "movl %%edx, 12(%%eax)" "\n\t"
+        "movl %%ecx,  8(%%eax)" "\n\t"
+        "movl %%ebx,  4(%%eax)" "\n\t"
+        "popl          (%%eax)" "\n\t"
+        "popl           %%ebx"
+      : "=a" (dummy)
+      : "0" (cmd)
+      : "ecx", "edx", "esi", "edi", "cc", "memory"
+   );
+#else
+#error "VMMouse is only supported on x86 and x86-64."
+#endif
+#endif
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProtoBackdoorSendCmd --
+ *
+ *      Send a request (16 bytes) to vmware through the backdoor port, and
+ *      synchronously return its reply (24 bytes).
+ *
+ * Result:
+ *      None
+ *
+ * Side-effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static void
+VMMouseProtoBackdoorSendCmd(VMMouseProtoCmd *cmd) // IN/OUT
+{
+   cmd->in.magic = VMMOUSE_PROTO_MAGIC;
+   cmd->in.port = VMMOUSE_PROTO_PORT;
+
+   VMMouseProtoInOut(cmd);
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProtoBackdoorReadBulk --
+ *
+ *      Read numWords dwords queued for the given command in a single
+ *      high-bandwidth transfer. Hosts that don't implement the bulk
+ *      transfer for this command leave the success status unset.
+ *
+ * Result:
+ *      The number of words the host transferred: rep insl counts ecx
+ *      down once per word, so a short transfer still dequeued
+ *      numWords - ecx words. 0 if the host reported a failure without
+ *      moving anything.
+ *
+ * Side-effects:
+ *      Dequeues the transferred words on the host.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static uint32_t
+VMMouseProtoBackdoorReadBulk(uint16_t command,   // IN
+                             uint32_t *data,     // OUT
+                             uint32_t numWords)  // IN
+{
+   VMMouseProtoCmd cmd;
+
+   /*
+    * The whole register file is loaded, so make sure the upper halves
+    * of rbx/rcx don't contain garbage.
+    */
+   memset(&cmd, 0, sizeof(cmd));
+   cmd.in.magic = VMMOUSE_PROTO_MAGIC;
+   cmd.in.vEbx = command;
+   cmd.in.vEcx = numWords;
+   cmd.in.vEdx = VMMOUSE_PROTO_HB_PORT;
+#ifdef __x86_64__
+   cmd.in.vRdi = (uintptr_t)data;
+#else
+   cmd.in.vEdi = (uintptr_t)data;
+#endif
+
+   VMMouseProtoInOutHB(&cmd);
+
+   if ((cmd.out.vEbx & VMMOUSE_PROTO_HB_STATUS_SUCCESS) &&
+       cmd.out.vEcx == 0) {
+      return numWords;
+   }
+   return cmd.out.vEcx < numWords ? numWords - cmd.out.vEcx : 0;
+}
+
+
+const VMMouseProtoTransport VMMouseProtoBackdoorTransport = {
+   "backdoor",
+   true,
+   VMMouseProtoBackdoorSendCmd,
+   VMMouseProtoBackdoorReadBulk
+};
+
+const VMMouseProtoTransport VMMouseProtoSimTransport = {
+   "sim",
+   false,
+   VMMouseSim_SendCmd,
+   VMMouseSim_ReadBulk
+};
+
+static const VMMouseProtoTransport *vmmouseTransports[] = {
+   &VMMouseProtoBackdoorTransport,
+   &VMMouseProtoSimTransport,
+   NULL
+};
+
+static const VMMouseProtoTransport *vmmouseTransport;
+
+static VMMouseProtoStats vmmouseStats;
+
+static const char *vmmouseStatNames[VMMOUSE_PROTO_STAT_MAX] = {
+   "GETVERSION",
+   "ABSPOINTER_DATA",
+   "ABSPOINTER_STATUS",
+   "ABSPOINTER_COMMAND",
+   "ABSPOINTER_RESTRICT",
+   "BULK",
+   "OTHER"
+};
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProtoRdtsc --
+ *
+ *      Read the time stamp counter.
+ *
+ * Result:
+ *      The current TSC value.
+ *
+ * Side-effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static inline uint64_t
+VMMouseProtoRdtsc(void)
+{
+   uint32_t lo, hi;
+
+   __asm__ __volatile__("rdtsc" : "=a" (lo), "=d" (hi));
+   return ((uint64_t)hi << 32) | lo;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProtoCmdStat --
+ *
+ *      Map a backdoor command to its accounting slot.
+ *
+ * Result:
+ *      The VMMouseProtoStat for the command.
+ *
+ * Side-effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static VMMouseProtoStat
+VMMouseProtoCmdStat(uint16_t command) // IN
+{
+   switch (command) {
+   case VMMOUSE_PROTO_CMD_GETVERSION:
+      return VMMOUSE_PROTO_STAT_GETVERSION;
+   case VMMOUSE_PROTO_CMD_ABSPOINTER_DATA:
+      return VMMOUSE_PROTO_STAT_ABSPOINTER_DATA;
+   case VMMOUSE_PROTO_CMD_ABSPOINTER_STATUS:
+      return VMMOUSE_PROTO_STAT_ABSPOINTER_STATUS;
+   case VMMOUSE_PROTO_CMD_ABSPOINTER_COMMAND:
+      return VMMOUSE_PROTO_STAT_ABSPOINTER_COMMAND;
+   case VMMOUSE_PROTO_CMD_ABSPOINTER_RESTRICT:
+      return VMMOUSE_PROTO_STAT_ABSPOINTER_RESTRICT;
+   default:
+      return VMMOUSE_PROTO_STAT_OTHER;
+   }
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProto_SetTransport --
+ *
+ *      Select the transport used for all subsequent requests by name.
+ *
+ * Result:
+ *      true if a transport with that name exists, false otherwise, in
+ *      which case the current transport is kept.
+ *
+ * Side-effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+bool
+VMMouseProto_SetTransport(const char *name) // IN
+{
+   int i;
+
+   for (i = 0; vmmouseTransports[i]; i++) {
+      if (!strcasecmp(vmmouseTransports[i]->name, name)) {
+         vmmouseTransport = vmmouseTransports[i];
+         return true;
+      }
+   }
+
+   return false;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProto_GetTransport --
+ *
+ *      Return the current transport, selecting the build-time default if
+ *      none was chosen yet.
+ *
+ * Result:
+ *      The current transport.
+ *
+ * Side-effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+const VMMouseProtoTransport *
+VMMouseProto_GetTransport(void)
+{
+   if (!vmmouseTransport &&
+       !VMMouseProto_SetTransport(VMMOUSE_DEFAULT_TRANSPORT)) {
+      vmmouseTransport = &VMMouseProtoBackdoorTransport;
+   }
+
+   return vmmouseTransport;
+}
+
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -140,8 +466,93 @@ VMMouseProtoInOut(VMMouseProtoCmd *cmd) // IN/OUT
 void
 VMMouseProto_SendCmd(VMMouseProtoCmd *cmd) // IN/OUT
 {
-   cmd->in.magic = VMMOUSE_PROTO_MAGIC;
-   cmd->in.port = VMMOUSE_PROTO_PORT;
+   const VMMouseProtoTransport *transport = VMMouseProto_GetTransport();
+   VMMouseProtoStat stat = VMMouseProtoCmdStat(cmd->in.command);
+   uint64_t start = VMMouseProtoRdtsc();
 
-   VMMouseProtoInOut(cmd);
+   transport->sendCmd(cmd);
+
+   vmmouseStats.cycles[stat] += VMMouseProtoRdtsc() - start;
+   vmmouseStats.calls[stat]++;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProto_ReadBulk --
+ *
+ *      Read numWords dwords queued for the given command in a single
+ *      transfer, if the transport and host support it.
+ *
+ * Result:
+ *      The number of words transferred, numWords on success.
+ *
+ * Side-effects:
+ *      Dequeues the transferred words on the host.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+uint32_t
+VMMouseProto_ReadBulk(uint16_t command,   // IN
+                      uint32_t *data,     // OUT
+                      uint32_t numWords)  // IN
+{
+   const VMMouseProtoTransport *transport = VMMouseProto_GetTransport();
+   uint64_t start = VMMouseProtoRdtsc();
+   uint32_t ret;
+
+   ret = transport->readBulk(command, data, numWords);
+
+   vmmouseStats.cycles[VMMOUSE_PROTO_STAT_BULK] += VMMouseProtoRdtsc() - start;
+   vmmouseStats.calls[VMMOUSE_PROTO_STAT_BULK]++;
+   return ret;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProto_GetStats --
+ *
+ *      Return the number of requests sent per command, and the TSC cycles
+ *      spent in them, since startup.
+ *
+ * Result:
+ *      Statistics returned in stats.
+ *
+ * Side-effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+void
+VMMouseProto_GetStats(VMMouseProtoStats *stats) // OUT
+{
+   *stats = vmmouseStats;
+}
+
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * VMMouseProto_StatName --
+ *
+ *      Return a printable name for an accounting slot.
+ *
+ * Result:
+ *      The name.
+ *
+ * Side-effects:
+ *      None
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+const char *
+VMMouseProto_StatName(VMMouseProtoStat stat) // IN
+{
+   return stat < VMMOUSE_PROTO_STAT_MAX ? vmmouseStatNames[stat] : "?";
 }
@@ -36,6 +36,7 @@
 #ifndef _VMMOUSE_PROTO_H_
 #define _VMMOUSE_PROTO_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <unistd.h>
 
@@ -54,6 +55,10 @@
 
 #define VMMOUSE_PROTO_MAGIC 0x564D5868
 #define VMMOUSE_PROTO_PORT 0x5658
+#define VMMOUSE_PROTO_HB_PORT 0x5659
+
+/* Set in the high word of ebx by hosts that completed a bulk transfer */
+#define VMMOUSE_PROTO_HB_STATUS_SUCCESS 0x00010000
 
 #define VMMOUSE_PROTO_CMD_GETVERSION		10
 #define VMMOUSE_PROTO_CMD_ABSPOINTER_DATA	39
@@ -122,9 +127,62 @@ typedef union {
 } VMMouseProtoCmd;
 
 
+/*
+ * Per-command accounting of the requests sent to the host. Every
+ * request is a VM exit on the backdoor transport.
+ */
+typedef enum {
+   VMMOUSE_PROTO_STAT_GETVERSION,
+   VMMOUSE_PROTO_STAT_ABSPOINTER_DATA,
+   VMMOUSE_PROTO_STAT_ABSPOINTER_STATUS,
+   VMMOUSE_PROTO_STAT_ABSPOINTER_COMMAND,
+   VMMOUSE_PROTO_STAT_ABSPOINTER_RESTRICT,
+   VMMOUSE_PROTO_STAT_BULK,
+   VMMOUSE_PROTO_STAT_OTHER,
+   VMMOUSE_PROTO_STAT_MAX
+} VMMouseProtoStat;
+
+typedef struct {
+   uint64_t calls[VMMOUSE_PROTO_STAT_MAX];
+   uint64_t cycles[VMMOUSE_PROTO_STAT_MAX];      /* TSC cycles */
+} VMMouseProtoStats;
+
+/*
+ * A transport carries backdoor requests to the host. The default one
+ * pokes the backdoor ports; others (e.g. the simulated host) allow the
+ * client and driver logic to run outside of a VMware virtual machine.
+ */
+typedef struct {
+   const char *name;
+   bool needsIO;        /* requires I/O privilege */
+   void (*sendCmd)(VMMouseProtoCmd *cmd);
+   /* returns the number of words dequeued, numWords on success */
+   uint32_t (*readBulk)(uint16_t command, uint32_t *data, uint32_t numWords);
+} VMMouseProtoTransport;
+
+extern const VMMouseProtoTransport VMMouseProtoBackdoorTransport;
+extern const VMMouseProtoTransport VMMouseProtoSimTransport;
+
+bool
+VMMouseProto_SetTransport(const char *name); // IN
+
+const VMMouseProtoTransport *
+VMMouseProto_GetTransport(void);
+
 void
 VMMouseProto_SendCmd(VMMouseProtoCmd *cmd); // IN/OUT
 
+uint32_t
+VMMouseProto_ReadBulk(uint16_t command,   // IN
+                      uint32_t *data,     // OUT
+                      uint32_t numWords); // IN
+
+
+void
+VMMouseProto_GetStats(VMMouseProtoStats *stats); // OUT
+
+const char *
+VMMouseProto_StatName(VMMouseProtoStat stat); // IN
 
 #undef DECLARE_REG_STRUCT
 
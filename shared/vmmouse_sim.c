@@ -0,0 +1,607 @@
+/*
+ * Copyright 2026 by the XLibre project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ */
+
+/*
+ * vmmouse_sim.c --
+ *
+ *      A simulated VMMouse host. It answers the backdoor requests the
+ *      way the VMX does, and generates pointer packets at a configurable
+ *      rate into a bounded ABSPOINTER queue. Absolute/relative switching,
+ *      VMMOUSE_ERROR injection and queue overflow can be exercised
+ *      through the configuration.
+ */
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vmmouse_defs.h"
+#include "vmmouse_sim.h"
+
+#define VMMOUSE_SIM_VERSION        6
+#define VMMOUSE_SIM_MAX_QUEUE      0xfffc       /* fits the status word */
+
+static VMMouseSimConfig simConfig = {
+   true,                /* present */
+   true,                /* deviceEnabled */
+   true,                /* bulk */
+   0,                   /* packetRate */
+   1024,                /* queueWords */
+   0,                   /* switchEvery */
+   0                    /* errorEvery */
+};
+
+static VMMouseSimStats simStats;
+
+static struct {
+   bool enabled;                /* READ_ID seen and not disabled since */
+   bool error;                  /* status reports VMMOUSE_ERROR */
+   bool relative;               /* guest requested relative packets */
+   uint32_t *queue;             /* queueWords dwords, allocated on use */
+   unsigned int head;
+   unsigned int count;
+   unsigned long statusQueries;
+   unsigned long seq;
+   uint64_t lastGenerated;      /* ns */
+} sim;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSimNow --
+ *
+ *      Read the monotonic clock.
+ *
+ * Results:
+ *      The current time in nanoseconds.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint64_t
+VMMouseSimNow(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSimFlush --
+ *
+ *      Empty the host queue.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Queued packets are lost.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+VMMouseSimFlush(void)
+{
+   sim.head = 0;
+   sim.count = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSimAlloc --
+ *
+ *      Allocate the host queue if it isn't yet. It is sized for the
+ *      configured capacity, and only allocated once something is
+ *      queued, so that builds never using the simulator don't pay for
+ *      it.
+ *
+ * Results:
+ *      true if the queue is available, false if the allocation failed.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static bool
+VMMouseSimAlloc(void)
+{
+   if (!sim.queue) {
+      sim.queue = malloc(simConfig.queueWords * sizeof(*sim.queue));
+   }
+   return sim.queue != NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSimPush / VMMouseSimPop --
+ *
+ *      Add a dword to the tail of, or remove one from the head of, the
+ *      host queue. Callers check for space or content.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+VMMouseSimPush(uint32_t word)
+{
+   sim.queue[(sim.head + sim.count) % simConfig.queueWords] = word;
+   sim.count++;
+}
+
+static uint32_t
+VMMouseSimPop(void)
+{
+   uint32_t word = sim.queue[sim.head];
+
+   sim.head = (sim.head + 1) % simConfig.queueWords;
+   sim.count--;
+   return word;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSimGenerate --
+ *
+ *      Queue the packets the configured rate called for since the last
+ *      request. The pattern is deterministic: a diagonal sweep in
+ *      absolute mode, small alternating steps in relative mode, the
+ *      left button toggling every 32 packets and a wheel tick every 16.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Packets that don't fit the queue are counted as dropped.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+VMMouseSimGenerate(void)
+{
+   uint64_t now = VMMouseSimNow();
+   uint64_t period;
+   uint64_t n;
+
+   if (!simConfig.packetRate || !sim.enabled || sim.error) {
+      sim.lastGenerated = now;
+      return;
+   }
+
+   period = 1000000000ULL / simConfig.packetRate;
+   if (period == 0) {
+      period = 1;
+   }
+   n = (now - sim.lastGenerated) / period;
+   sim.lastGenerated += n * period;
+
+   /*
+    * Anything beyond one queue's worth would be dropped anyway.
+    */
+   if (n > simConfig.queueWords / 4) {
+      simStats.packetsDropped += n - simConfig.queueWords / 4;
+      n = simConfig.queueWords / 4;
+   }
+
+   while (n--) {
+      bool relative = sim.relative;
+      uint32_t buttons = 0;
+      uint32_t x, y, z = 0;
+
+      sim.seq++;
+      if (simConfig.switchEvery && (sim.seq / simConfig.switchEvery) % 2) {
+         relative = !relative;
+      }
+      if ((sim.seq / 32) % 2) {
+         buttons |= VMMOUSE_LEFT_BUTTON;
+      }
+      if (sim.seq % 16 == 0) {
+         z = (uint32_t)-1;
+      }
+      if (relative) {
+         x = (sim.seq % 2) ? 3 : (uint32_t)-3;
+         y = (sim.seq % 2) ? 2 : (uint32_t)-2;
+      } else {
+         x = (sim.seq * 97) & 0xffff;
+         y = (sim.seq * 53) & 0xffff;
+      }
+
+      VMMouseSim_QueuePacket((relative ? VMMOUSE_MOVE_RELATIVE :
+                              VMMOUSE_MOVE_ABSOLUTE) << 16 | buttons,
+                             x, y, z);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSim_Configure --
+ *
+ *      Replace the simulated host configuration and reset its state and
+ *      statistics.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The host queue is released and the device disabled.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+VMMouseSim_Configure(const VMMouseSimConfig *config) // IN
+{
+   simConfig = *config;
+   if (simConfig.queueWords < 4) {
+      simConfig.queueWords = 4;
+   } else if (simConfig.queueWords > VMMOUSE_SIM_MAX_QUEUE) {
+      simConfig.queueWords = VMMOUSE_SIM_MAX_QUEUE;
+   }
+
+   free(sim.queue);
+   memset(&sim, 0, sizeof(sim));
+   memset(&simStats, 0, sizeof(simStats));
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSim_Shutdown --
+ *
+ *      Release the host queue. The simulator can be used again, the
+ *      queue is allocated on demand.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Queued packets are lost.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+VMMouseSim_Shutdown(void)
+{
+   free(sim.queue);
+   sim.queue = NULL;
+   VMMouseSimFlush();
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSim_ConfigureFromString --
+ *
+ *      Configure the simulated host from a comma separated list of
+ *      key=value pairs: present, enabled, bulk, rate, queue, switch and
+ *      error, matching the VMMouseSimConfig fields. Keys not listed keep
+ *      their current value.
+ *
+ * Results:
+ *      true on success, false if the string could not be parsed, in
+ *      which case the configuration is left untouched.
+ *
+ * Side effects:
+ *      See VMMouseSim_Configure.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+bool
+VMMouseSim_ConfigureFromString(const char *spec) // IN
+{
+   VMMouseSimConfig config = simConfig;
+   const char *p = spec;
+
+   while (*p) {
+      const char *eq = strchr(p, '=');
+      unsigned long value;
+      size_t len;
+      char *end;
+
+      if (!eq) {
+         return false;
+      }
+      len = eq - p;
+      value = strtoul(eq + 1, &end, 0);
+      if (end == eq + 1 || (*end && *end != ',')) {
+         return false;
+      }
+
+      if (len == 7 && !strncmp(p, "present", len)) {
+         config.present = value != 0;
+      } else if (len == 7 && !strncmp(p, "enabled", len)) {
+         config.deviceEnabled = value != 0;
+      } else if (len == 4 && !strncmp(p, "bulk", len)) {
+         config.bulk = value != 0;
+      } else if (len == 4 && !strncmp(p, "rate", len)) {
+         config.packetRate = value;
+      } else if (len == 5 && !strncmp(p, "queue", len)) {
+         config.queueWords = value;
+      } else if (len == 6 && !strncmp(p, "switch", len)) {
+         config.switchEvery = value;
+      } else if (len == 5 && !strncmp(p, "error", len)) {
+         config.errorEvery = value;
+      } else {
+         return false;
+      }
+
+      p = *end ? end + 1 : end;
+   }
+
+   VMMouseSim_Configure(&config);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSim_GetStats --
+ *
+ *      Return the simulated host statistics.
+ *
+ * Results:
+ *      Statistics returned in stats.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+VMMouseSim_GetStats(VMMouseSimStats *stats) // OUT
+{
+   *stats = simStats;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSim_QueuePacket --
+ *
+ *      Queue a 4-dword packet on the host, as if the user had moved the
+ *      host pointer.
+ *
+ * Results:
+ *      true if the packet was queued, false if the queue was full or
+ *      could not be allocated.
+ *
+ * Side effects:
+ *      Overflowing packets are counted as dropped.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+bool
+VMMouseSim_QueuePacket(uint32_t packetInfo, // IN
+                       uint32_t x,          // IN
+                       uint32_t y,          // IN
+                       uint32_t z)          // IN
+{
+   if (sim.count + 4 > simConfig.queueWords || !VMMouseSimAlloc()) {
+      simStats.packetsDropped++;
+      return false;
+   }
+
+   VMMouseSimPush(packetInfo);
+   VMMouseSimPush(x);
+   VMMouseSimPush(y);
+   VMMouseSimPush(z);
+   simStats.packetsQueued++;
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSim_QueueWords --
+ *
+ *      Queue raw dwords on the host, such as part of a packet, to test
+ *      how the client recovers from a misaligned queue.
+ *
+ * Results:
+ *      true if the words were queued, false if the queue was full.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+bool
+VMMouseSim_QueueWords(const uint32_t *words, // IN
+                      unsigned int numWords) // IN
+{
+   unsigned int i;
+
+   if (sim.count + numWords > simConfig.queueWords || !VMMouseSimAlloc()) {
+      return false;
+   }
+
+   for (i = 0; i < numWords; i++) {
+      VMMouseSimPush(words[i]);
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSim_SendCmd --
+ *
+ *      Answer a low-bandwidth backdoor request like the VMX does.
+ *
+ * Results:
+ *      Host-side response returned in cmd IN/OUT parameter.
+ *
+ * Side effects:
+ *      Simulated host state change.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+void
+VMMouseSim_SendCmd(VMMouseProtoCmd *cmd) // IN/OUT
+{
+   uint16_t command = cmd->in.command;
+   uint32_t arg = cmd->in.vEbx;
+   uint32_t out[4] = { 0, 0, 0, 0 };
+   unsigned int i;
+
+   simStats.commands++;
+   VMMouseSimGenerate();
+
+   switch (command) {
+   case VMMOUSE_PROTO_CMD_GETVERSION:
+      if (!simConfig.present) {
+         cmd->out.vEax = 0xffffffff;
+         cmd->out.vEbx = 0;
+         break;
+      }
+      cmd->out.vEax = VMMOUSE_SIM_VERSION;
+      cmd->out.vEbx = VMMOUSE_PROTO_MAGIC;
+      break;
+
+   case VMMOUSE_PROTO_CMD_ABSPOINTER_COMMAND:
+      switch (arg) {
+      case VMMOUSE_CMD_READ_ID:
+         if (!simConfig.deviceEnabled || !VMMouseSimAlloc()) {
+            break;
+         }
+         sim.enabled = true;
+         sim.error = false;
+         VMMouseSimFlush();
+         VMMouseSimPush(VMMOUSE_VERSION_ID);
+         sim.lastGenerated = VMMouseSimNow();
+         break;
+      case VMMOUSE_CMD_DISABLE:
+         sim.enabled = false;
+         sim.error = true;
+         VMMouseSimFlush();
+         break;
+      case VMMOUSE_CMD_REQUEST_RELATIVE:
+         sim.relative = true;
+         break;
+      case VMMOUSE_CMD_REQUEST_ABSOLUTE:
+         sim.relative = false;
+         break;
+      }
+      break;
+
+   case VMMOUSE_PROTO_CMD_ABSPOINTER_STATUS:
+      sim.statusQueries++;
+      if (sim.enabled && !sim.error && simConfig.errorEvery &&
+          sim.statusQueries % simConfig.errorEvery == 0) {
+         sim.error = true;
+         simStats.errorsInjected++;
+      }
+      cmd->out.vEax = sim.error ? VMMOUSE_ERROR : sim.count;
+      break;
+
+   case VMMOUSE_PROTO_CMD_ABSPOINTER_DATA:
+      for (i = 0; i < arg && i < 4 && sim.count; i++) {
+         out[i] = VMMouseSimPop();
+      }
+      cmd->out.vEax = out[0];
+      cmd->out.vEbx = out[1];
+      cmd->out.vEcx = out[2];
+      cmd->out.vEdx = out[3];
+      break;
+
+   case VMMOUSE_PROTO_CMD_ABSPOINTER_RESTRICT:
+      simStats.restrictLevel = arg;
+      break;
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * VMMouseSim_ReadBulk --
+ *
+ *      Answer a high-bandwidth transfer of the data queue.
+ *
+ * Results:
+ *      numWords if they were all transferred, 0 if bulk transfers are
+ *      disabled or not enough words are queued.
+ *
+ * Side effects:
+ *      Dequeues the transferred words.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+uint32_t
+VMMouseSim_ReadBulk(uint16_t command,   // IN
+                    uint32_t *data,     // OUT
+                    uint32_t numWords)  // IN
+{
+   uint32_t i;
+
+   simStats.commands++;
+   VMMouseSimGenerate();
+
+   if (!simConfig.bulk || command != VMMOUSE_PROTO_CMD_ABSPOINTER_DATA ||
+       !sim.enabled || sim.error || numWords > sim.count) {
+      return 0;
+   }
+
+   for (i = 0; i < numWords; i++) {
+      data[i] = VMMouseSimPop();
+   }
+   simStats.bulkTransfers++;
+   return numWords;
+}
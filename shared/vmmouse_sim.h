@@ -0,0 +1,93 @@
+/*
+ * Copyright 2026 by the XLibre project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ */
+
+/*
+ * vmmouse_sim.h --
+ *
+ *      A simulated VMMouse host. It models the ABSPOINTER queue of the
+ *      VMX closely enough to exercise the client and driver logic on
+ *      machines that are not VMware virtual machines.
+ */
+
+#ifndef _VMMOUSE_SIM_H_
+#define _VMMOUSE_SIM_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "vmmouse_proto.h"
+
+typedef struct {
+   bool present;                /* answer GETVERSION */
+   bool deviceEnabled;          /* answer READ_ID with VERSION_ID */
+   bool bulk;                   /* complete high-bandwidth transfers */
+   unsigned int packetRate;     /* generated packets per second */
+   unsigned int queueWords;     /* host queue capacity, in dwords */
+   unsigned int switchEvery;    /* flip absolute/relative every N packets */
+   unsigned int errorEvery;     /* fail every Nth status query */
+} VMMouseSimConfig;
+
+typedef struct {
+   unsigned long commands;      /* backdoor requests handled */
+   unsigned long bulkTransfers; /* high-bandwidth transfers completed */
+   unsigned long packetsQueued; /* packets added to the host queue */
+   unsigned long packetsDropped; /* packets lost to queue overflow */
+   unsigned long errorsInjected; /* VMMOUSE_ERROR statuses injected */
+   unsigned int restrictLevel;  /* last RESTRICT argument */
+} VMMouseSimStats;
+
+void
+VMMouseSim_Configure(const VMMouseSimConfig *config); // IN
+
+bool
+VMMouseSim_ConfigureFromString(const char *spec); // IN
+
+void
+VMMouseSim_Shutdown(void);
+
+void
+VMMouseSim_GetStats(VMMouseSimStats *stats); // OUT
+
+bool
+VMMouseSim_QueuePacket(uint32_t packetInfo, // IN
+                       uint32_t x,          // IN
+                       uint32_t y,          // IN
+                       uint32_t z);         // IN
+
+bool
+VMMouseSim_QueueWords(const uint32_t *words, // IN
+                      unsigned int numWords); // IN
+
+void
+VMMouseSim_SendCmd(VMMouseProtoCmd *cmd); // IN/OUT
+
+uint32_t
+VMMouseSim_ReadBulk(uint16_t command,   // IN
+                    uint32_t *data,     // OUT
+                    uint32_t numWords); // IN
+
+#endif /* _VMMOUSE_SIM_H_ */
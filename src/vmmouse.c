@@ -43,6 +43,20 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#endif
 #include <X11/X.h>
 #include <X11/Xproto.h>
 
@@ -68,11 +82,17 @@
 
 #include "xisb.h"
 #include "mipointer.h"
+#ifdef RANDR
+#include "randrstr.h"
+#endif
 
 /*****************************************************************************
  *	Local Headers
  ****************************************************************************/
 #include "vmmouse_client.h"
+#include "vmmouse_hypervisor.h"
+#include "vmmouse_proto.h"
+#include "vmmouse_sim.h"
 
 /*
  * This is the only way I know to turn a #define of an integer constant into
@@ -113,9 +133,39 @@ const char vm_mouse_version[] __attribute__((section(".modinfo"),unused)) =
 static int VMMousePreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags);
 static void VMMouseUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags);
 static void MouseCommonOptions(InputInfoPtr pInfo);
-static void GetVMMouseMotionEvent(InputInfoPtr pInfo);
+static unsigned int GetVMMouseMotionEvent(InputInfoPtr pInfo);
+static CARD32 VMMousePollTimer(OsTimerPtr timer, CARD32 now, void *arg);
+static CARD32 VMMouseDrainTimer(OsTimerPtr timer, CARD32 now, void *arg);
+static CARD32 VMMouseRecoverTimer(OsTimerPtr timer, CARD32 now, void *arg);
+static CARD32 VMMouseEnableTimer(OsTimerPtr timer, CARD32 now, void *arg);
+static CARD32 VMMouseSimTimer(OsTimerPtr timer, CARD32 now, void *arg);
+static void VMMouseStartInput(InputInfoPtr pInfo);
+static void VMMouseUpdateScreenMap(InputInfoPtr pInfo);
+static void VMMouseBlockHandler(void *data, void *timeout);
+static CARD32 VMMousePaceTimer(OsTimerPtr timer, CARD32 now, void *arg);
+static CARD32 VMMouseDisableTimer(OsTimerPtr timer, CARD32 now, void *arg);
+static void VMMouseHostDisable(InputInfoPtr pInfo);
+static void VMMousePaceFlush(InputInfoPtr pInfo);
+static void VMMouseProcessPacket(InputInfoPtr pInfo, PVMMOUSE_INPUT_DATA pInput);
+static void VMMousePostBatch(InputInfoPtr pInfo, PVMMOUSE_INPUT_DATA packets,
+                             unsigned int numPackets);
+static void VMMouseReportDiscarded(void);
+static unsigned int VMMouseCoalesce(InputInfoPtr pInfo, PVMMOUSE_INPUT_DATA packets,
+                                    unsigned int numPackets);
+#ifdef __linux__
+static int  VMMouseEvdevFind(char paths[][PATH_MAX]);
+static bool VMMouseEvdevOpen(InputInfoPtr pInfo);
+static void VMMouseEvdevClose(InputInfoPtr pInfo);
+static void VMMouseEvdevReadInput(InputInfoPtr pInfo);
+static bool VMMouseThreadStart(InputInfoPtr pInfo);
+static void VMMouseThreadStop(InputInfoPtr pInfo);
+static void VMMouseThreadReadInput(InputInfoPtr pInfo);
+#endif
 static void VMMousePostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy, int dz, int dw);
-static void VMMouseDoPostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy);
+static bool VMMouseDoPostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy);
+static void VMMouseWheelNone(InputInfoPtr pInfo, int dz);
+static void VMMouseWheelButtons(InputInfoPtr pInfo, int dz);
+static void VMMouseWheelScroll(InputInfoPtr pInfo, int dz);
 static Bool VMMouseDeviceControl(DeviceIntPtr device, int mode);
 static int  VMMouseControlProc(InputInfoPtr pInfo, xDeviceCtl * control);
 static void VMMouseReadInput(InputInfoPtr pInfo);
@@ -125,12 +175,210 @@ static void MouseCtrl(DeviceIntPtr device, PtrCtrl *ctrl);
 /******************************************************************************
  *		Definitions
  *****************************************************************************/
+
+/*
+ * Input latency histograms, in log2 nanosecond buckets: bucket n counts
+ * samples in [2^n, 2^(n+1)) ns.
+ */
+#define VMMOUSE_LATENCY_BUCKETS	32
+
+typedef enum {
+   VMMOUSE_LATENCY_DECODE,	/* read_input entry to packet decode */
+   VMMOUSE_LATENCY_POST,	/* packet decode to xf86Post*Event return */
+   VMMOUSE_LATENCY_TOTAL,	/* read_input entry to xf86Post*Event return */
+   VMMOUSE_LATENCY_MAX
+} VMMouseLatency;
+
+typedef struct {
+   unsigned long       count[VMMOUSE_LATENCY_BUCKETS];
+} VMMouseLatencyHist;
+
+/*
+ * The kernel vmmouse driver registers an absolute and a relative input
+ * device under this name.
+ */
+#define VMMOUSE_KERNEL_DEVNAME	"VirtualPS/2 VMware VMMouse"
+#define VMMOUSE_EVDEV_MAX	2
+
+#ifdef __linux__
+typedef struct {
+   int                 fd;
+   bool                absolute;	/* reports ABS_X/ABS_Y */
+   bool                pending;	/* events since the last SYN_REPORT */
+   bool                dropped;	/* SYN_DROPPED, skip to SYN_REPORT */
+   int                 buttons;	/* VMMOUSE_*_BUTTON held on this device */
+   int                 x, y;		/* last absolute position */
+   int                 dx, dy, dz;	/* accumulated relative motion */
+} VMMouseEvdevRec, *VMMouseEvdevPtr;
+#endif
+
+#ifdef __linux__
+/*
+ * Single-producer/single-consumer ring between the reader thread and the
+ * server. head is only written by the reader thread, tail only by the
+ * server; the size must be a power of two. Motion is merged rather than
+ * queued once fewer than VMMOUSE_RING_RESERVE slots are free, so that
+ * button transitions always find room.
+ */
+#define VMMOUSE_RING_SIZE	1024
+#define VMMOUSE_RING_RESERVE	64
+
+typedef struct {
+   VMMOUSE_INPUT_DATA  packets[VMMOUSE_RING_SIZE];
+   unsigned int        head;
+   unsigned int        tail;
+} VMMouseRing;
+#endif
+
+/*
+ * Axis transform applied to each packet: optional swap, then
+ * v' = v * scale + offset per axis.
+ */
+typedef struct {
+   bool                swap;
+   int                 xScale, xOffset;
+   int                 yScale, yOffset;
+} VMMouseAxisXform;
+
+typedef void (*VMMouseWheelProc)(InputInfoPtr pInfo, int dz);
+
+/*
+ * Mapping of absolute host coordinates onto part of the desktop, in
+ * 16.16 fixed point: v' = (v * scale + offset) >> 16.
+ */
+typedef struct {
+   int64_t             xScale, xOffset;
+   int64_t             yScale, yOffset;
+} VMMouseScreenMap;
+
+/* Desktop layout the screen map was computed for */
+typedef struct {
+   int                 generation;
+   int                 numScreens;
+   int                 width, height;
+#ifdef RANDR
+   CARD32              rrSetTime, rrConfigTime;
+#endif
+} VMMouseLayout;
+
+/* Index of the VMMOUSE_*_BUTTON bits in the button table */
+#define VMMOUSE_BUTTON_INDEX(b)	(((b) >> 3) & 0x07)
+
+/*
+ * Host side of the device across DEVICE_OFF/DEVICE_ON. On DEVICE_OFF the
+ * host is left enabled for VMMOUSE_DISABLE_DELAY ms so that a quick
+ * DEVICE_ON (VT switch, screen lock) can skip the enable handshake and
+ * only discard what was queued meanwhile. Otherwise DEVICE_ON leaves
+ * the handshake to a timer and returns at once.
+ */
+typedef enum {
+   VMMOUSE_HOST_DISABLED,
+   VMMOUSE_HOST_ENABLED,
+   VMMOUSE_HOST_DISABLE_PENDING,
+   VMMOUSE_HOST_ENABLE_PENDING,
+} VMMouseHostState;
+
+#define VMMOUSE_DISABLE_DELAY	300
+
+/*
+ * The simulated host has no PS/2 side to announce queued packets, so it
+ * is polled every VMMOUSE_SIM_INTERVAL ms while the device is on.
+ */
+#define VMMOUSE_SIM_INTERVAL	4
+
+/*
+ * Recovery from VMMOUSE_ERROR. The host is reset from a timer (or the
+ * reader thread's poll timeout) after a delay that doubles, from
+ * VMMOUSE_RECOVER_MIN to VMMOUSE_RECOVER_MAX ms, for as long as reads
+ * keep failing; no more than VMMOUSE_RECOVER_PER_SEC resets are made in
+ * any one second. Input is not read while a reset is pending.
+ */
+typedef enum {
+   VMMOUSE_RECOVER_NONE,
+   VMMOUSE_RECOVER_PENDING,
+} VMMouseRecoverState;
+
+#define VMMOUSE_RECOVER_MIN	10
+#define VMMOUSE_RECOVER_MAX	1000
+#define VMMOUSE_RECOVER_PER_SEC	4
+
 typedef struct {
-   int                 screenNum;
+   int                 screenNum;		/* -1 for the whole desktop */
+   char               *output;		/* RandR output name or NULL */
+   bool                screenMapped;	/* screenMap is in use */
+   VMMouseScreenMap    screenMap;	/* published under input_lock() */
+   bool                blockHandler;	/* watching the desktop layout */
+   VMMouseLayout       layout;
    bool                vmmouseAvailable;
    VMMOUSE_INPUT_DATA  vmmousePrevInput;
    bool                isCurrRelative;
    bool                absoluteRequested;
+   int                 probeFd;		/* PS/2 fd opened by PreInit */
+   VMMouseHostState    hostState;
+   OsTimerPtr          disableTimer;
+   OsTimerPtr          enableTimer;
+   bool                simHost;		/* sim transport, polled */
+   OsTimerPtr          simTimer;
+   unsigned long       drainsAvoided;
+   VMMouseRecoverState recoverState;
+   CARD32              recoverDelay;	/* ms, 0 after a good read */
+   OsTimerPtr          recoverTimer;
+   uint64_t            recoverWindow;	/* start of the rate window */
+   unsigned int        recoverWindowResets;
+   uint64_t            errorSince;	/* time the error was seen */
+   uint64_t            errorNsec;	/* total time spent in error */
+   unsigned long       resets;
+   unsigned long       resetsThrottled;
+   bool                coalesce;
+   unsigned long       packetsCoalesced;
+   bool                pollMode;
+   CARD32              pollMin;		/* ms */
+   CARD32              pollMax;		/* ms */
+   CARD32              pollInterval;	/* ms, 0 when idle */
+   OsTimerPtr          pollTimer;
+   unsigned long       polls;
+   unsigned int        budgetPackets;	/* per wakeup, 0 for no limit */
+   uint64_t            budgetNsec;	/* per wakeup, 0 for no limit */
+   OsTimerPtr          drainTimer;
+   unsigned long       budgetExhausted;
+   bool                smoothScroll;	/* wheel on a scroll valuator */
+   int                 buttonMap[8];	/* VMMouse buttons to X buttons */
+   VMMouseAxisXform    xform[2];	/* absolute, relative */
+   int                 wheelToX, wheelToY;
+   VMMouseWheelProc    wheelProc;
+   ValuatorMask       *mask;		/* reused for every posted event */
+   bool                motionFilter;
+   int                 jitterRadius;	/* pixels */
+   int                 filterX, filterY;	/* last accepted pixel */
+   unsigned long       filterDropped;
+   uint64_t            paceNsec;	/* motion frame interval, 0 if off */
+   uint64_t            paceLast;	/* time of the last posted motion */
+   bool                pacePending;	/* absolute motion held back */
+   int                 paceX, paceY;
+   OsTimerPtr          paceTimer;
+   unsigned long       paceDropped;
+   bool                readerThread;
+#ifdef __linux__
+   bool                threadRunning;
+   pthread_t           thread;
+   int                 ps2Fd;		/* PS/2 fd read by the thread */
+   int                 wakeFd;		/* eventfd used as pInfo->fd */
+   int                 stopFd;		/* eventfd stopping the thread */
+   int                 threadError;	/* host error, thread paused */
+   VMMouseRing         ring;
+   unsigned long       ringOverflows;
+#endif
+   bool                latencyStats;
+   uint64_t            latencyWakeup;
+   uint64_t            latencyDecode;
+   VMMouseLatencyHist  latency[VMMOUSE_LATENCY_MAX];
+   bool                useEvdev;
+#ifdef __linux__
+   int                 evdevNum;
+   int                 evdevNext;	/* device read first next time */
+   bool                evdevGrab;	/* EVIOCGRAB the devices */
+   VMMouseEvdevRec     evdev[VMMOUSE_EVDEV_MAX];
+#endif
 } VMMousePrivRec, *VMMousePrivPtr;
 
 InputDriverRec VMMOUSE = {
@@ -142,12 +390,66 @@ InputDriverRec VMMOUSE = {
    NULL
 };
 
-static char reverseMap[32] = { 0,  4,  2,  6,  1,  5,  3,  7,
-			       8, 12, 10, 14,  9, 13, 11, 15,
-			      16, 20, 18, 22, 17, 21, 19, 23,
-			      24, 28, 26, 30, 25, 29, 27, 31};
+static const char *latencyNames[VMMOUSE_LATENCY_MAX] = {
+   "decode", "post", "total"
+};
+
+/*
+ * Maximum number of packets pulled from the host per status query.
+ */
+#define VMMOUSE_DRAIN_PACKETS	128
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseNow --
+ *	Read the monotonic clock
+ *
+ * Results:
+ * 	The current time in nanoseconds
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static uint64_t
+VMMouseNow(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseLatencyRecord --
+ *	Account a latency sample in its log2 bucket
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseLatencyRecord(VMMousePrivPtr mPriv, VMMouseLatency which,
+		     uint64_t start, uint64_t end)
+{
+   uint64_t ns = end - start;
+   int bucket = 0;
 
-#define reverseBits(map, b)	(((b) & ~0x0f) | map[(b) & 0x0f])
+   while ((ns >>= 1) && bucket < VMMOUSE_LATENCY_BUCKETS - 1)
+      bucket++;
+   mPriv->latency[which].count[bucket]++;
+}
 
 static int
 VMMouseInitPassthru(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
@@ -200,25 +502,117 @@ VMMousePreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
    MouseDevPtr pMse = NULL;
    VMMousePrivPtr mPriv = NULL;
    int rc = Success;
+   bool useEvdev = false;
+   bool hostEnabled = false;
+   uint32_t hostVersion = 0;
+   bool hypervisorCheck = true;
+   bool simHost = false;
+   uint64_t start, tProbe = 0, tEnable = 0, tOpen;
+   char *s;
 
-   /* Enable hardware access. */
-   if (!xorgHWAccess) {
-      if (xf86EnableIO())
-          xorgHWAccess = true;
-      else {
-          rc = BadValue;
-          goto error;
+   start = VMMouseNow();
+
+   /* Select how backdoor requests reach the host. */
+   s = xf86CheckStrOption(pInfo->options, "Transport", NULL);
+   if (s) {
+      if (!xf86NameCmp(s, "evdev"))
+	 useEvdev = true;
+      else if (!VMMouseProto_SetTransport(s))
+	 xf86Msg(X_WARNING, "%s: unknown transport \"%s\"\n", pInfo->name, s);
+      free(s);
+   }
+
+   /*
+    * The evdev transport reads the kernel vmmouse driver's devices and
+    * never touches the backdoor, so it needs no I/O privileges.
+    */
+   if (useEvdev) {
+#ifdef __linux__
+      char paths[VMMOUSE_EVDEV_MAX][PATH_MAX];
+
+      if (VMMouseEvdevFind(paths) == 0) {
+	 xf86Msg(X_WARNING, "%s: no kernel vmmouse device, "
+		 "using the backdoor\n", pInfo->name);
+	 useEvdev = false;
       }
+#else
+      xf86Msg(X_WARNING, "%s: evdev transport not supported, "
+	      "using the backdoor\n", pInfo->name);
+      useEvdev = false;
+#endif
    }
 
-   /* For ABI < 12, we need to return the wrapped driver's pInfo (see
-    * above). ABI 12, we call NIDR and are done */
-   if (!VMMouseClient_Enable()) {
-      xf86Msg(X_ERROR, "VMWARE(0): vmmouse enable failed\n");
-      return VMMouseInitPassthru(drv, pInfo, flags);
+   if (useEvdev) {
+      xf86Msg(X_INFO, "%s: using evdev transport\n", pInfo->name);
    } else {
-      xf86Msg(X_INFO, "VMWARE(0): vmmouse is available\n");
-      VMMouseClient_Disable();
+      s = xf86CheckStrOption(pInfo->options, "SimHost", NULL);
+      if (s) {
+	 if (!VMMouseSim_ConfigureFromString(s))
+	    xf86Msg(X_WARNING, "%s: invalid SimHost value \"%s\"\n",
+		    pInfo->name, s);
+	 free(s);
+      }
+      xf86Msg(X_INFO, "%s: using %s transport\n", pInfo->name,
+	      VMMouseProto_GetTransport()->name);
+      simHost = VMMouseProto_GetTransport() == &VMMouseProtoSimTransport;
+
+      /*
+       * Only raise the I/O privilege level and probe the port when
+       * CPUID says the backdoor may be there, see vmmouse_hypervisor.h.
+       */
+      hypervisorCheck = xf86SetBoolOption(pInfo->options, "HypervisorCheck",
+					  true);
+      if (VMMouseProto_GetTransport()->needsIO && hypervisorCheck) {
+	 VMMouseHypervisor hv = VMMouseHypervisor_Detect();
+	 bool other = xf86SetBoolOption(pInfo->options,
+					"OtherHypervisors", false);
+
+	 if (!VMMouseHypervisor_MayHaveBackdoor(hv, other)) {
+	    xf86Msg(X_INFO, "%s: running on %s, not probing the backdoor\n",
+		    pInfo->name, VMMouseHypervisor_Name(hv));
+	    return VMMouseInitPassthru(drv, pInfo, flags);
+	 }
+      }
+
+      /* Enable hardware access. */
+      if (VMMouseProto_GetTransport()->needsIO && !xorgHWAccess) {
+	 if (xf86EnableIO())
+	    xorgHWAccess = true;
+	 else if (!hypervisorCheck) {
+	    /*
+	     * Under a harness that emulates the port, the probe traps
+	     * whether or not I/O was enabled; let it decide.
+	     */
+	    xf86Msg(X_WARNING, "%s: cannot enable I/O, probing anyway\n",
+		    pInfo->name);
+	 } else {
+	    rc = BadValue;
+	    goto error;
+	 }
+      }
+
+      /* For ABI < 12, we need to return the wrapped driver's pInfo (see
+       * above). ABI 12, we call NIDR and are done */
+      tProbe = VMMouseNow();
+      if (!VMMouseClient_Probe(&hostVersion)) {
+	 xf86Msg(X_ERROR, "VMWARE(0): vmmouse enable failed\n");
+	 return VMMouseInitPassthru(drv, pInfo, flags);
+      }
+      tProbe = VMMouseNow() - tProbe;
+
+      /*
+       * The host is left enabled so that DEVICE_ON does not have to
+       * repeat the handshake.
+       */
+      tEnable = VMMouseNow();
+      if (!VMMouseClient_Enable()) {
+	 xf86Msg(X_ERROR, "VMWARE(0): vmmouse enable failed\n");
+	 return VMMouseInitPassthru(drv, pInfo, flags);
+      } else {
+	 xf86Msg(X_INFO, "VMWARE(0): vmmouse is available\n");
+	 hostEnabled = true;
+      }
+      tEnable = VMMouseNow() - tEnable;
    }
 
    mPriv = calloc (1, sizeof (VMMousePrivRec));
@@ -227,9 +621,26 @@ VMMousePreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
       rc = BadAlloc;
       goto error;
    }
+   mPriv->probeFd = -1;
+
+   mPriv->mask = valuator_mask_new(3);
+   if (!mPriv->mask) {
+      rc = BadAlloc;
+      goto error;
+   }
 
    mPriv->absoluteRequested = false;
-   mPriv->vmmouseAvailable = true;
+   mPriv->vmmouseAvailable = !useEvdev;
+   mPriv->useEvdev = useEvdev;
+   mPriv->simHost = simHost;
+   mPriv->hostState = hostEnabled ? VMMOUSE_HOST_DISABLE_PENDING
+				  : VMMOUSE_HOST_DISABLED;
+#ifdef __linux__
+   mPriv->ps2Fd = mPriv->wakeFd = mPriv->stopFd = -1;
+   if (useEvdev)
+      mPriv->evdevGrab = xf86SetBoolOption(pInfo->options, "EvdevGrab",
+					   false);
+#endif
 
    /* Settup the pInfo */
    pInfo->type_name = XI_MOUSE;
@@ -251,9 +662,13 @@ VMMousePreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
    pMse->mousePriv = mPriv;
 
 
-   /* Check if the device can be opened. */
-   pInfo->fd = xf86OpenSerial(pInfo->options);
-   if (pInfo->fd == -1) {
+   /*
+    * Check if the device can be opened. The fd is kept for DEVICE_ON.
+    * The simulated host does not need one.
+    */
+   tOpen = VMMouseNow();
+   pInfo->fd = useEvdev || simHost ? -1 : xf86OpenSerial(pInfo->options);
+   if (!useEvdev && !simHost && pInfo->fd == -1) {
       if (xf86GetAllowMouseOpenFail())
 	 xf86Msg(X_WARNING, "%s: cannot open input device\n", pInfo->name);
       else {
@@ -262,21 +677,106 @@ VMMousePreInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
 	 goto error;
       }
    }
-   xf86CloseSerial(pInfo->fd);
+   mPriv->probeFd = pInfo->fd;
    pInfo->fd = -1;
+   tOpen = VMMouseNow() - tOpen;
 
    /* Process the options */
    pMse->CommonOptions(pInfo);
 
    /* set up the current screen num */
-   mPriv->screenNum = xf86SetIntOption(pInfo->options, "ScreenNumber", 0);
+   mPriv->screenNum = xf86SetIntOption(pInfo->options, "ScreenNumber", -1);
+   if (mPriv->screenNum >= MAXSCREENS)
+      mPriv->screenNum = -1;
+   mPriv->output = xf86SetStrOption(pInfo->options, "Output", NULL);
+   mPriv->layout.generation = -1;
+
+   mPriv->latencyStats = xf86SetBoolOption(pInfo->options, "LatencyStats",
+					   false);
+   mPriv->coalesce = xf86SetBoolOption(pInfo->options, "Coalesce", false);
+   VMMouseClient_SetBulk(xf86SetBoolOption(pInfo->options, "BulkTransfer",
+					   false));
+
+   mPriv->pollMode = xf86SetBoolOption(pInfo->options, "PollMode", false);
+   if (mPriv->pollMode) {
+      int min = xf86SetIntOption(pInfo->options, "PollMinInterval", 4);
+      int max = xf86SetIntOption(pInfo->options, "PollMaxInterval", 128);
+
+      if (min < 1)
+	 min = 1;
+      if (max < min)
+	 max = min;
+      mPriv->pollMin = min;
+      mPriv->pollMax = max;
+   }
+
+   {
+      int packets = xf86SetIntOption(pInfo->options, "DrainBudgetPackets", 0);
+      int usec = xf86SetIntOption(pInfo->options, "DrainBudgetUsec", 0);
+
+      mPriv->budgetPackets = packets > 0 ? packets : 0;
+      mPriv->budgetNsec = usec > 0 ? (uint64_t)usec * 1000 : 0;
+   }
+
+   mPriv->motionFilter = xf86SetBoolOption(pInfo->options, "MotionFilter",
+					   false);
+   mPriv->jitterRadius = xf86SetIntOption(pInfo->options, "JitterRadius", 0);
+   if (mPriv->jitterRadius < 0)
+      mPriv->jitterRadius = 0;
+   mPriv->filterX = mPriv->filterY = -1;
+
+   {
+      int rate = xf86SetIntOption(pInfo->options, "MotionRate", 0);
+
+      mPriv->paceNsec = rate > 0 ? 1000000000ULL / rate : 0;
+   }
+
+   mPriv->readerThread = xf86SetBoolOption(pInfo->options, "ReaderThread",
+					   false);
+#ifndef __linux__
+   if (mPriv->readerThread) {
+      xf86Msg(X_WARNING, "%s: ReaderThread is not supported\n", pInfo->name);
+      mPriv->readerThread = false;
+   }
+#endif
+   if (mPriv->readerThread && (useEvdev || simHost || mPriv->pollMode)) {
+      xf86Msg(X_WARNING, "%s: ReaderThread ignored with %s\n", pInfo->name,
+	      useEvdev ? "the evdev transport" :
+	      simHost ? "the sim transport" : "PollMode");
+      mPriv->readerThread = false;
+   }
+
+   /*
+    * Like after DEVICE_OFF, the host only stays enabled for a quick
+    * DEVICE_ON; if none comes it must not keep the PS/2 stream in
+    * vmmouse mode.
+    */
+   if (mPriv->hostState == VMMOUSE_HOST_DISABLE_PENDING)
+      mPriv->disableTimer = TimerSet(mPriv->disableTimer, 0,
+				     VMMOUSE_DISABLE_DELAY,
+				     VMMouseDisableTimer, pInfo);
+
+   if (!useEvdev)
+      xf86Msg(X_INFO, "VMWARE(0): host version %u, startup took %llu us "
+	      "(probe %llu, enable %llu, open %llu)\n", hostVersion,
+	      (unsigned long long)(VMMouseNow() - start) / 1000,
+	      (unsigned long long)tProbe / 1000,
+	      (unsigned long long)tEnable / 1000,
+	      (unsigned long long)tOpen / 1000);
 
    return Success;
 
 error:
    pInfo->private = NULL;
-   if (mPriv)
+   if (hostEnabled)
+      VMMouseClient_Disable();
+   if (mPriv) {
+      if (mPriv->probeFd != -1)
+	 xf86CloseSerial(mPriv->probeFd);
+      valuator_mask_free(&mPriv->mask);
+      free(mPriv->output);
       free(mPriv);
+   }
    if (pMse)
       free(pMse);
 
@@ -318,6 +818,41 @@ MouseCtrl(DeviceIntPtr device, PtrCtrl *ctrl)
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseFilterMotion --
+ * 	Decide whether an absolute position is visible. The position
+ *	is scaled to the desktop the way the server scales the
+ *	valuators; it is dropped when it lands on the last accepted
+ *	pixel or within the jitter radius around it.
+ *
+ * Results:
+ * 	true if the motion should be dropped
+ *
+ * Side effects:
+ * 	The accepted pixel is remembered
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+VMMouseFilterMotion(VMMousePrivPtr mPriv, int x, int y)
+{
+    int px = (int)(((int64_t)x * screenInfo.width) >> 16);
+    int py = (int)(((int64_t)y * screenInfo.height) >> 16);
+
+    if (mPriv->filterX >= 0 &&
+        abs(px - mPriv->filterX) <= mPriv->jitterRadius &&
+        abs(py - mPriv->filterY) <= mPriv->jitterRadius)
+        return true;
+
+    mPriv->filterX = px;
+    mPriv->filterY = py;
+    return false;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -325,7 +860,7 @@ MouseCtrl(DeviceIntPtr device, PtrCtrl *ctrl)
  *	Post the mouse button event and mouse motion event to Xserver
  *
  * Results:
- * 	None
+ * 	true if an event was posted now
  *
  * Side effects:
  * 	Mouse location and button status was updated
@@ -333,27 +868,17 @@ MouseCtrl(DeviceIntPtr device, PtrCtrl *ctrl)
  *----------------------------------------------------------------------
  */
 
-static void
+static bool
 VMMouseDoPostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy)
 {
     MouseDevPtr pMse;
     VMMousePrivPtr mPriv;
-    int truebuttons;
     int id, change;
     bool mouseMoved = false;
 
     pMse = pInfo->private;
     mPriv = (VMMousePrivPtr)pMse->mousePriv;
 
-    /*
-     * The following truebuttons/reverseBits and lastButtons are
-     * used to compare the current buttons and the previous buttons
-     * to find the button changes during two mouse events
-     */
-    truebuttons = buttons;
-
-    buttons = reverseBits(reverseMap, buttons);
-
     if (mPriv->isCurrRelative) {
        mouseMoved = dx || dy;
     } else {
@@ -361,20 +886,136 @@ VMMouseDoPostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy)
                     (dy != mPriv->vmmousePrevInput.Y) ||
                     (mPriv->vmmousePrevInput.Flags & VMMOUSE_MOVE_RELATIVE);
     }
+    if (mouseMoved && mPriv->motionFilter && !mPriv->isCurrRelative &&
+        buttons == pMse->lastButtons &&
+        VMMouseFilterMotion(mPriv, dx, dy)) {
+        mPriv->filterDropped++;
+        mouseMoved = false;
+    }
+
+    /*
+     * Absolute motion is paced to at most one event per frame; the
+     * latest position is held and posted by the pace timer. Button
+     * changes, including wheel buttons, post their position at once.
+     */
+    if (mouseMoved && mPriv->paceNsec && !mPriv->isCurrRelative &&
+        buttons == pMse->lastButtons) {
+        uint64_t now = VMMouseNow();
+        uint64_t next = mPriv->paceLast + mPriv->paceNsec;
+
+        if (now < next) {
+            if (mPriv->pacePending)
+                mPriv->paceDropped++;
+            else
+                mPriv->paceTimer = TimerSet(mPriv->paceTimer, 0,
+                                            (next - now + 999999) / 1000000,
+                                            VMMousePaceTimer, pInfo);
+            mPriv->pacePending = true;
+            mPriv->paceX = dx;
+            mPriv->paceY = dy;
+            return false;
+        }
+    }
+    /* Anything posted now must not overtake the held position. */
+    if (mPriv->pacePending && mouseMoved && !mPriv->isCurrRelative) {
+        TimerCancel(mPriv->paceTimer);
+        mPriv->pacePending = false;
+        mPriv->paceDropped++;
+    } else {
+        VMMousePaceFlush(pInfo);
+    }
+
+    valuator_mask_zero(mPriv->mask);
     if (mouseMoved) {
-        xf86PostMotionEvent(pInfo->dev, !mPriv->isCurrRelative, 0, 2, dx, dy);
+        valuator_mask_set(mPriv->mask, 0, dx);
+        valuator_mask_set(mPriv->mask, 1, dy);
+        if (mPriv->paceNsec && !mPriv->isCurrRelative)
+            mPriv->paceLast = VMMouseNow();
+        if (mPriv->isCurrRelative)
+            mPriv->filterX = -1;	/* the pixel is no longer known */
     }
 
-    if (truebuttons != pMse->lastButtons) {
-       change = buttons ^ reverseBits(reverseMap, pMse->lastButtons);
+    /*
+     * buttons and lastButtons are X button masks, bit n for button n+1.
+     * The motion travels with the first button event; the mask is
+     * emptied afterwards so relative motion is not applied twice.
+     */
+    if (buttons != pMse->lastButtons) {
+       change = buttons ^ pMse->lastButtons;
        while (change) {
 	  id = ffs(change);
 	  change &= ~(1 << (id - 1));
-	  xf86PostButtonEvent(pInfo->dev, 0, id,
-			      (buttons & (1 << (id - 1))), 0, 0);
+	  xf86PostButtonEventM(pInfo->dev,
+			       mPriv->isCurrRelative ? Relative : Absolute, id,
+			       (buttons & (1 << (id - 1))), mPriv->mask);
+	  valuator_mask_zero(mPriv->mask);
        }
-       pMse->lastButtons = truebuttons;
+       pMse->lastButtons = buttons;
+    } else if (mouseMoved) {
+       xf86PostMotionEventM(pInfo->dev,
+			    mPriv->isCurrRelative ? Relative : Absolute,
+			    mPriv->mask);
+    } else {
+       return false;
     }
+    return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMousePaceTimer --
+ * 	Post the absolute position held back by motion pacing
+ *
+ * Results:
+ * 	0
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMousePaceTimer(OsTimerPtr timer _X_UNUSED, CARD32 now _X_UNUSED, void *arg)
+{
+    VMMousePaceFlush(arg);
+    return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMousePaceFlush --
+ * 	Post the absolute position held back by motion pacing, if any
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	The pace timer is cancelled
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMousePaceFlush(InputInfoPtr pInfo)
+{
+    MouseDevPtr pMse = pInfo->private;
+    VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+    if (!mPriv->pacePending)
+        return;
+
+    TimerCancel(mPriv->paceTimer);
+    valuator_mask_zero(mPriv->mask);
+    valuator_mask_set(mPriv->mask, 0, mPriv->paceX);
+    valuator_mask_set(mPriv->mask, 1, mPriv->paceY);
+    xf86PostMotionEventM(pInfo->dev, Absolute, mPriv->mask);
+    mPriv->paceLast = VMMouseNow();
+    mPriv->pacePending = false;
 }
 
 
@@ -382,14 +1023,14 @@ VMMouseDoPostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy)
  *----------------------------------------------------------------------
  *
  * VMMousePostEvent --
- *	Prepare the mouse status according to the Z axis mapping
- *	before we post the event to Xserver
+ *	Post an event with the Z axis handled by the mode chosen in
+ *	MouseCommonOptions
  *
  * Results:
  * 	None
  *
  * Side effects:
- * 	Buttons was updated according to Z axis mapping
+ * 	None
  *
  *----------------------------------------------------------------------
  */
@@ -398,66 +1039,31 @@ static void
 VMMousePostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy, int dz, int dw)
 {
     MouseDevPtr pMse;
-    int zbutton = 0;
     VMMousePrivPtr mPriv;
+    bool posted;
 
     pMse = pInfo->private;
     mPriv = (VMMousePrivPtr)pMse->mousePriv;
-    /* Map the Z axis movement. */
-    /* XXX Could this go in the conversion_proc? */
-    switch (pMse->negativeZ) {
-    case MSE_NOZMAP:	/* do nothing */
-	break;
-    case MSE_MAPTOX:
-	if (dz != 0) {
-	   if(mPriv->isCurrRelative)
-	      dx = dz;
-	   else
-	      dx += dz;
-	    dz = 0;
-	}
-	break;
-    case MSE_MAPTOY:
-	if (dz != 0) {
-	   if(mPriv->isCurrRelative)
-	      dy = dz;
-	   else
-	      dy += dz;
-	    dz = 0;
-	}
-	break;
-    default:	/* buttons */
-	buttons &= ~(pMse->negativeZ | pMse->positiveZ
-		   | pMse->negativeW | pMse->positiveW);
-	if (dw < 0 || dz < -1) {
-	    zbutton = pMse->negativeW;
-	}
-	else if (dz < 0) {
-	    zbutton = pMse->negativeZ;
-	}
-	else if (dw > 0 || dz > 1) {
-	    zbutton = pMse->positiveW;
-	}
-	else if (dz > 0) {
-	    zbutton = pMse->positiveZ;
-	}
-	buttons |= zbutton;
-	dz = 0;
-	break;
+
+    /* ZAxisMapping "x" or "y" moves the pointer along that axis. */
+    dx += dz * mPriv->wheelToX;
+    dy += dz * mPriv->wheelToY;
+
+    posted = VMMouseDoPostEvent(pInfo, buttons, dx, dy);
+
+    if (dz && mPriv->wheelProc != VMMouseWheelNone) {
+	mPriv->wheelProc(pInfo, dz);
+	posted = true;
     }
 
-    VMMouseDoPostEvent(pInfo, buttons, dx, dy);
+    /* Wheel-only packets count too; motion held by pacing does not. */
+    if (posted && mPriv->latencyStats) {
+       uint64_t now = VMMouseNow();
 
-    /*
-     * If dz has been mapped to a button `down' event, we need to cook up
-     * a corresponding button `up' event.
-     */
-    if (zbutton) {
-	buttons &= ~zbutton;
-	if(mPriv->isCurrRelative)
-	   VMMouseDoPostEvent(pInfo, buttons, 0, 0);
-	else
-	   VMMouseDoPostEvent(pInfo, buttons, dx, dy);
+       VMMouseLatencyRecord(mPriv, VMMOUSE_LATENCY_POST,
+			    mPriv->latencyDecode, now);
+       VMMouseLatencyRecord(mPriv, VMMOUSE_LATENCY_TOTAL,
+			    mPriv->latencyWakeup, now);
     }
 }
 
@@ -465,9 +1071,8 @@ VMMousePostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy, int dz, int dw
 /*
  *----------------------------------------------------------------------
  *
- * FlushButtons --
- *
- * 	FlushButtons -- reset button states.
+ * VMMouseWheelNone --
+ *	Wheel handler when the wheel is unmapped or mapped to an axis
  *
  * Results:
  * 	None
@@ -479,56 +1084,143 @@ VMMousePostEvent(InputInfoPtr pInfo, int buttons, int dx, int dy, int dz, int dw
  */
 
 static void
-FlushButtons(MouseDevPtr pMse)
+VMMouseWheelNone(InputInfoPtr pInfo _X_UNUSED, int dz _X_UNUSED)
 {
-    pMse->lastButtons = 0;
 }
 
 
 /*
  *----------------------------------------------------------------------
  *
- * MouseCommonOptions --
- *	Process acceptable mouse options. Currently we only process
- *	"Buttons" and "ZAxisMapping" options.
- *	More options can be added later on
+ * VMMouseWheelButtons --
+ *	Post one press and release of the mapped button per wheel tick
  *
  * Results:
  * 	None
  *
  * Side effects:
- * 	The buttons was setup according to the options
+ * 	Motion held by pacing is posted first
  *
  *----------------------------------------------------------------------
  */
 
 static void
-MouseCommonOptions(InputInfoPtr pInfo)
+VMMouseWheelButtons(InputInfoPtr pInfo, int dz)
 {
-   MouseDevPtr pMse;
-   char *s;
+    MouseDevPtr pMse = pInfo->private;
+    VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+    int id = ffs(dz < 0 ? pMse->negativeZ : pMse->positiveZ);
+    int clicks = abs(dz);
+
+    VMMousePaceFlush(pInfo);
+    valuator_mask_zero(mPriv->mask);
+    while (clicks--) {
+	xf86PostButtonEventM(pInfo->dev, Relative, id, 1, mPriv->mask);
+	xf86PostButtonEventM(pInfo->dev, Relative, id, 0, mPriv->mask);
+    }
+}
 
-   pMse = pInfo->private;
 
-   pMse->buttons = xf86SetIntOption(pInfo->options, "Buttons", 0);
-   if (!pMse->buttons) {
-      pMse->buttons = MSE_DFLTBUTTONS;
-   }
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseWheelScroll --
+ *	Post the wheel on the scroll valuator; the server emulates
+ *	buttons 4 and 5 for legacy clients
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	Motion held by pacing is posted first
+ *
+ *----------------------------------------------------------------------
+ */
 
-   /*
-    * "emulate3Buttons" and "Drag Lock" is not supported
-    */
+static void
+VMMouseWheelScroll(InputInfoPtr pInfo, int dz)
+{
+    MouseDevPtr pMse = pInfo->private;
+    VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
 
-   /*
-    * Process option for ZAxisMapping
-    */
-   s = xf86SetStrOption(pInfo->options, "ZAxisMapping", "4 5");
-   if (s) {
-      int b1 = 0, b2 = 0, b3 = 0, b4 = 0;
-      char *msg = NULL;
+    VMMousePaceFlush(pInfo);
+    valuator_mask_zero(mPriv->mask);
+    valuator_mask_set(mPriv->mask, 2, dz);
+    xf86PostMotionEventM(pInfo->dev, Relative, mPriv->mask);
+}
 
-      if (!xf86NameCmp(s, "x")) {
-	 pMse->negativeZ = pMse->positiveZ = MSE_MAPTOX;
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * FlushButtons --
+ *
+ * 	FlushButtons -- reset button states.
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+FlushButtons(MouseDevPtr pMse)
+{
+    pMse->lastButtons = 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MouseCommonOptions --
+ *	Process acceptable mouse options: "Buttons", "ZAxisMapping",
+ *	"SmoothScroll", "ButtonMapping", "InvX", "InvY" and "FlipXY".
+ *	The result is compiled into the button table, the axis
+ *	transforms and the wheel handler used for every packet.
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	The buttons was setup according to the options
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MouseCommonOptions(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse;
+   VMMousePrivPtr mPriv;
+   char *s;
+   int i;
+
+   pMse = pInfo->private;
+   mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+   pMse->buttons = xf86SetIntOption(pInfo->options, "Buttons", 0);
+   if (!pMse->buttons) {
+      pMse->buttons = MSE_DFLTBUTTONS;
+   }
+
+   /*
+    * "emulate3Buttons" and "Drag Lock" is not supported
+    */
+
+   /*
+    * Process option for ZAxisMapping
+    */
+   s = xf86SetStrOption(pInfo->options, "ZAxisMapping", "4 5");
+   if (s) {
+      int b1 = 0, b2 = 0, b3 = 0, b4 = 0;
+      char *msg = NULL;
+
+      if (!xf86NameCmp(s, "x")) {
+	 pMse->negativeZ = pMse->positiveZ = MSE_MAPTOX;
 	 pMse->negativeW = pMse->positiveW = MSE_MAPTOX;
 	 msg = strdup("X axis");
       } else if (!xf86NameCmp(s, "y")) {
@@ -562,6 +1254,91 @@ MouseCommonOptions(InputInfoPtr pInfo)
 		 pInfo->name, s);
       }
    }
+
+   /*
+    * The server emulates buttons 4 and 5 from a vertical scroll
+    * valuator, so smooth scrolling only matches the default mapping.
+    * It adds a third valuator that clients would see, so it is opt-in.
+    */
+   mPriv->smoothScroll = xf86SetBoolOption(pInfo->options, "SmoothScroll",
+					   false);
+   if (mPriv->smoothScroll &&
+       (pMse->negativeZ != 1 << 3 || pMse->positiveZ != 1 << 4)) {
+      xf86Msg(X_WARNING, "%s: SmoothScroll requires ZAxisMapping \"4 5\"\n",
+	      pInfo->name);
+      mPriv->smoothScroll = false;
+   }
+
+   /*
+    * Compile the wheel mode.
+    */
+   mPriv->wheelToX = pMse->negativeZ == MSE_MAPTOX;
+   mPriv->wheelToY = pMse->negativeZ == MSE_MAPTOY;
+   if (mPriv->smoothScroll)
+      mPriv->wheelProc = VMMouseWheelScroll;
+   else if (pMse->negativeZ > 0)
+      mPriv->wheelProc = VMMouseWheelButtons;
+   else
+      mPriv->wheelProc = VMMouseWheelNone;
+
+   /*
+    * Compile the button table: Option "ButtonMapping" gives the X
+    * buttons for the left, middle and right VMMouse buttons.
+    */
+   {
+      int map[3] = { 1, 2, 3 };
+      int bits[3] = { VMMOUSE_LEFT_BUTTON, VMMOUSE_MIDDLE_BUTTON,
+		      VMMOUSE_RIGHT_BUTTON };
+      int j;
+
+      s = xf86SetStrOption(pInfo->options, "ButtonMapping", NULL);
+      if (s) {
+	 int b[3];
+
+	 if (sscanf(s, "%d %d %d", &b[0], &b[1], &b[2]) == 3 &&
+	     b[0] > 0 && b[0] <= MSE_MAXBUTTONS &&
+	     b[1] > 0 && b[1] <= MSE_MAXBUTTONS &&
+	     b[2] > 0 && b[2] <= MSE_MAXBUTTONS) {
+	    for (j = 0; j < 3; j++) {
+	       map[j] = b[j];
+	       if (b[j] > pMse->buttons)
+		  pMse->buttons = b[j];
+	    }
+	    xf86Msg(X_CONFIG, "%s: ButtonMapping: %d %d %d\n", pInfo->name,
+		    map[0], map[1], map[2]);
+	 } else {
+	    xf86Msg(X_WARNING, "%s: Invalid ButtonMapping value: \"%s\"\n",
+		    pInfo->name, s);
+	 }
+	 free(s);
+      }
+
+      for (i = 0; i < 8; i++) {
+	 mPriv->buttonMap[i] = 0;
+	 for (j = 0; j < 3; j++) {
+	    if (VMMOUSE_BUTTON_INDEX(bits[j]) & i)
+	       mPriv->buttonMap[i] |= 1 << (map[j] - 1);
+	 }
+      }
+   }
+
+   /*
+    * Compile the axis transforms. Absolute coordinates are inverted
+    * within 0..65535, relative ones by negating the delta.
+    */
+   pMse->invX = xf86SetBoolOption(pInfo->options, "InvX", false) ? -1 : 1;
+   pMse->invY = xf86SetBoolOption(pInfo->options, "InvY", false) ? -1 : 1;
+   pMse->flipXY = xf86SetBoolOption(pInfo->options, "FlipXY", false);
+   for (i = 0; i < 2; i++) {
+      VMMouseAxisXform *t = &mPriv->xform[i];
+      bool relative = i == 1;
+
+      t->swap = pMse->flipXY;
+      t->xScale = pMse->invX;
+      t->yScale = pMse->invY;
+      t->xOffset = (!relative && pMse->invX < 0) ? 65535 : 0;
+      t->yOffset = (!relative && pMse->invY < 0) ? 65535 : 0;
+   }
 }
 
 
@@ -590,6 +1367,23 @@ VMMouseUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
 
    if (pMse) {
        VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+       if (mPriv) {
+	  /* Never turned on or closed */
+	  if (mPriv->disableTimer)
+	     TimerFree(mPriv->disableTimer);
+	  if (mPriv->enableTimer)
+	     TimerFree(mPriv->enableTimer);
+	  if (mPriv->simTimer)
+	     TimerFree(mPriv->simTimer);
+	  if (mPriv->simHost)
+	     VMMouseSim_Shutdown();
+	  if (mPriv->hostState == VMMOUSE_HOST_DISABLE_PENDING)
+	     VMMouseClient_Disable();
+	  if (mPriv->probeFd != -1)
+	     xf86CloseSerial(mPriv->probeFd);
+	  valuator_mask_free(&mPriv->mask);
+	  free(mPriv->output);
+       }
        free(mPriv);
    }
 
@@ -597,6 +1391,107 @@ VMMouseUnInit(InputDriverPtr drv, InputInfoPtr pInfo, int flags)
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseLogStats --
+ * 	Log the backdoor accounting collected since startup. This runs
+ *	on every DEVICE_OFF, so the routine counters only appear at
+ *	verbosity 3 and above, and only for the features in use; host
+ *	errors and resyncs are logged whenever they happened.
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define VMMOUSE_STATS_VERB	3
+
+static void
+VMMouseLogStats(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   VMMouseProtoStats protoStats;
+   VMMOUSE_CLIENT_STATS clientStats;
+   int i;
+
+   VMMouseClient_GetStats(&clientStats);
+   if (clientStats.WordsDiscarded)
+      xf86Msg(X_INFO, "VMWARE(0): %llu queue words discarded on resync\n",
+	      (unsigned long long)clientStats.WordsDiscarded);
+   if (mPriv->resets || mPriv->errorNsec)
+      xf86Msg(X_INFO, "VMWARE(0): %lu host resets (%lu throttled), "
+	      "%llu ms in error\n", mPriv->resets, mPriv->resetsThrottled,
+	      (unsigned long long)mPriv->errorNsec / 1000000);
+
+   if (xf86GetVerbosity() >= VMMOUSE_STATS_VERB) {
+      VMMouseProto_GetStats(&protoStats);
+      for (i = 0; i < VMMOUSE_PROTO_STAT_MAX; i++) {
+	 if (!protoStats.calls[i])
+	    continue;
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): %s: %llu calls, %llu cycles\n",
+		     VMMouseProto_StatName(i),
+		     (unsigned long long)protoStats.calls[i],
+		     (unsigned long long)protoStats.cycles[i]);
+      }
+      if (clientStats.Packets)
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): %llu packets, %.2f exits and %.0f cycles "
+		     "per packet\n", (unsigned long long)clientStats.Packets,
+		     clientStats.ExitsPerPacket, clientStats.CyclesPerPacket);
+      if (mPriv->drainsAvoided)
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): %lu empty backdoor drains avoided\n",
+		     mPriv->drainsAvoided);
+      if (mPriv->coalesce)
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): %lu packets coalesced\n",
+		     mPriv->packetsCoalesced);
+      if (mPriv->pollMode)
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): %lu timer polls\n", mPriv->polls);
+      if (mPriv->motionFilter)
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): %lu motion events filtered\n",
+		     mPriv->filterDropped);
+      if (mPriv->paceNsec)
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): %lu motion events merged by pacing\n",
+		     mPriv->paceDropped);
+      if (mPriv->budgetPackets || mPriv->budgetNsec)
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): drain budget exhausted %lu times\n",
+		     mPriv->budgetExhausted);
+#ifdef __linux__
+      if (mPriv->readerThread)
+	 xf86MsgVerb(X_INFO, VMMOUSE_STATS_VERB,
+		     "VMWARE(0): %lu motion packets merged on a full "
+		     "ring\n", mPriv->ringOverflows);
+#endif
+   }
+
+   if (!mPriv->latencyStats)
+      return;
+   for (i = 0; i < VMMOUSE_LATENCY_MAX; i++) {
+      int b;
+
+      for (b = 0; b < VMMOUSE_LATENCY_BUCKETS; b++) {
+	 if (!mPriv->latency[i].count[b])
+	    continue;
+	 xf86Msg(X_INFO, "VMWARE(0): %s latency %llu-%llu ns: %lu\n",
+		 latencyNames[i], b ? 1ULL << b : 0ULL, (2ULL << b) - 1,
+		 mPriv->latency[i].count[b]);
+      }
+   }
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -621,13 +1516,17 @@ VMMouseDeviceControl(DeviceIntPtr device, int mode)
 {
    InputInfoPtr pInfo;
    MouseDevPtr pMse;
+   VMMousePrivPtr mPriv;
    unsigned char map[MSE_MAXBUTTONS + 1];
    int i;
+   uint64_t start = VMMouseNow();
+   const char *how = "";
    Atom btn_labels[MSE_MAXBUTTONS] = {0};
-   Atom axes_labels[2] = { 0, 0 };
+   Atom axes_labels[3] = { 0, 0, 0 };
 
    pInfo = device->public.devicePrivate;
    pMse = pInfo->private;
+   mPriv = (VMMousePrivPtr)pMse->mousePriv;
    pMse->device = device;
 
    switch (mode){
@@ -650,12 +1549,14 @@ VMMouseDeviceControl(DeviceIntPtr device, int mode)
 
       axes_labels[0] = XIGetKnownProperty(AXIS_LABEL_PROP_ABS_X);
       axes_labels[1] = XIGetKnownProperty(AXIS_LABEL_PROP_ABS_Y);
+      axes_labels[2] = XIGetKnownProperty(AXIS_LABEL_PROP_REL_VSCROLL);
 
       InitPointerDeviceStruct((DevicePtr)device, map,
 			      min(pMse->buttons, MSE_MAXBUTTONS),
 				btn_labels,
                                 pMse->Ctrl,
-                                GetMotionHistorySize(), 2
+                                GetMotionHistorySize(),
+				mPriv->smoothScroll ? 3 : 2
 				, axes_labels
                                 );
 
@@ -673,6 +1574,16 @@ VMMouseDeviceControl(DeviceIntPtr device, int mode)
                                 , Absolute
                                 );
       xf86InitValuatorDefaults(device, 1);
+      /* Vertical scroll valuator, one wheel tick per unit */
+      if (mPriv->smoothScroll) {
+	 xf86InitValuatorAxisStruct(device, 2,
+				   axes_labels[2],
+				   NO_AXIS_LIMITS, NO_AXIS_LIMITS, 0, 0, 0
+				   , Relative
+				   );
+	 SetScrollValuator(device, 2, SCROLL_TYPE_VERTICAL, 1.0,
+			   SCROLL_FLAG_PREFERRED);
+      }
 
       xf86Msg(X_INFO, "VMWARE(0): VMMOUSE DEVICE_INIT\n");
 #ifdef EXTMOUSEDEBUG
@@ -683,51 +1594,215 @@ VMMouseDeviceControl(DeviceIntPtr device, int mode)
 
    case DEVICE_ON:
       xf86Msg(X_INFO, "VMWARE(0): VMMOUSE DEVICE_ON\n");
-      pInfo->fd = xf86OpenSerial(pInfo->options);
-      if (pInfo->fd == -1)
-	 xf86Msg(X_WARNING, "%s: cannot open input device\n", pInfo->name);
-      else {
-	 pMse->buffer = XisbNew(pInfo->fd, 64);
-	 if (!pMse->buffer) {
-	    xf86CloseSerial(pInfo->fd);
-	    pInfo->fd = -1;
+      if (mPriv->useEvdev) {
+#ifdef __linux__
+	 if (!VMMouseEvdevOpen(pInfo)) {
+	    xf86Msg(X_ERROR, "%s: cannot open kernel vmmouse devices\n",
+		    pInfo->name);
+	    device->public.on = false;
+	    return !Success;
+	 }
+	 xf86AddEnabledDevice(pInfo);
+#endif
+      } else if (mPriv->simHost) {
+	 /*
+	  * The handshake is free with the simulated host, and resets
+	  * its queue.
+	  */
+	 TimerCancel(mPriv->disableTimer);
+	 if (!VMMouseClient_Enable()) {
+	    xf86Msg(X_ERROR, "VMWARE(0): vmmouse enable failed\n");
+	    mPriv->hostState = VMMOUSE_HOST_DISABLED;
+	    device->public.on = false;
+	    return !Success;
+	 }
+	 mPriv->hostState = VMMOUSE_HOST_ENABLED;
+	 mPriv->vmmouseAvailable = true;
+	 mPriv->simTimer = TimerSet(mPriv->simTimer, 0, VMMOUSE_SIM_INTERVAL,
+				    VMMouseSimTimer, pInfo);
+      } else {
+	 if (mPriv->probeFd != -1) {
+	    /* Opened by PreInit */
+	    pInfo->fd = mPriv->probeFd;
+	    mPriv->probeFd = -1;
 	 } else {
-	    VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
-	    if (mPriv != NULL) {
+	    pInfo->fd = xf86OpenSerial(pInfo->options);
+	 }
+	 if (pInfo->fd == -1)
+	    xf86Msg(X_WARNING, "%s: cannot open input device\n", pInfo->name);
+	 else {
+	    pMse->buffer = XisbNew(pInfo->fd, 64);
+	    if (!pMse->buffer) {
+	       xf86CloseSerial(pInfo->fd);
+	       pInfo->fd = -1;
+	    } else {
 	       /*
-		* enable absolute pointing device here
+		* If the host was never disabled since the last DEVICE_OFF,
+		* only drop what it queued while nobody was reading, so
+		* that clicks on another VT are not replayed here.
 		*/
-	       if (!VMMouseClient_Enable()) {
-		  xf86Msg(X_ERROR, "VMWARE(0): vmmouse enable failed\n");
-		  mPriv->vmmouseAvailable = false;
-		  device->public.on = false;
-		  return false;
+	       if (mPriv->hostState == VMMOUSE_HOST_DISABLE_PENDING) {
+		  unsigned int stale;
+
+		  TimerCancel(mPriv->disableTimer);
+		  stale = VMMouseClient_Flush();
+		  VMMouseReportDiscarded();
+		  if (stale == VMMOUSE_ERROR) {
+		     mPriv->hostState = VMMOUSE_HOST_DISABLED;
+		  } else {
+		     mPriv->hostState = VMMOUSE_HOST_ENABLED;
+		     mPriv->vmmouseAvailable = true;
+		     how = ", host still enabled";
+		     if (stale)
+			xf86Msg(X_INFO, "VMWARE(0): %u stale packets "
+				"discarded\n", stale);
+		  }
+	       }
+	       xf86FlushInput(pInfo->fd);
+	       if (mPriv->hostState == VMMOUSE_HOST_ENABLED) {
+		  VMMouseStartInput(pInfo);
 	       } else {
-		  mPriv->vmmouseAvailable = true;
-		  xf86Msg(X_INFO, "VMWARE(0): vmmouse enabled\n");
+		  /* The handshake is left to VMMouseEnableTimer. */
+		  how = ", handshake deferred";
+		  mPriv->hostState = VMMOUSE_HOST_ENABLE_PENDING;
+		  mPriv->vmmouseAvailable = false;
+		  mPriv->enableTimer = TimerSet(mPriv->enableTimer, 0, 1,
+						VMMouseEnableTimer, pInfo);
 	       }
 	    }
-	    xf86FlushInput(pInfo->fd);
-	    xf86AddEnabledDevice(pInfo);
 	 }
       }
+      if (mPriv->screenNum >= 0 || mPriv->output) {
+	 mPriv->layout.generation = -1;
+	 VMMouseUpdateScreenMap(pInfo);
+	 if (!mPriv->blockHandler)
+	    mPriv->blockHandler =
+	       RegisterBlockAndWakeupHandlers(VMMouseBlockHandler,
+					      (ServerWakeupHandlerProcPtr)NoopDDA,
+					      pInfo);
+      }
       pMse->lastButtons = 0;
       device->public.on = true;
       FlushButtons(pMse);
+      xf86Msg(X_INFO, "VMWARE(0): DEVICE_ON took %llu us%s\n",
+	      (unsigned long long)(VMMouseNow() - start) / 1000, how);
       break;
    case DEVICE_OFF:
    case DEVICE_CLOSE:
       xf86Msg(X_INFO, "VMWARE(0): VMMOUSE DEVICE_OFF/CLOSE\n");
 
+      if (mPriv->blockHandler) {
+	 RemoveBlockAndWakeupHandlers(VMMouseBlockHandler,
+				      (ServerWakeupHandlerProcPtr)NoopDDA,
+				      pInfo);
+	 mPriv->blockHandler = false;
+      }
+
+#ifdef __linux__
+      if (mPriv->useEvdev) {
+	 VMMouseLogStats(pInfo);
+	 VMMouseEvdevClose(pInfo);
+      }
+#endif
+      if (mPriv->simTimer) {
+	 TimerCancel(mPriv->simTimer);
+	 if (mode == DEVICE_CLOSE) {
+	    TimerFree(mPriv->simTimer);
+	    mPriv->simTimer = NULL;
+	 }
+      }
+      if (mPriv->simHost && mPriv->vmmouseAvailable) {
+	 mPriv->vmmouseAvailable = false;
+	 VMMouseHostDisable(pInfo);
+	 VMMouseLogStats(pInfo);
+      }
+      if (mPriv->pollTimer) {
+	 TimerCancel(mPriv->pollTimer);
+	 mPriv->pollInterval = 0;
+	 if (mode == DEVICE_CLOSE) {
+	    TimerFree(mPriv->pollTimer);
+	    mPriv->pollTimer = NULL;
+	 }
+      }
+      if (mPriv->drainTimer) {
+	 TimerCancel(mPriv->drainTimer);
+	 if (mode == DEVICE_CLOSE) {
+	    TimerFree(mPriv->drainTimer);
+	    mPriv->drainTimer = NULL;
+	 }
+      }
+      if (mPriv->paceTimer) {
+	 TimerCancel(mPriv->paceTimer);
+	 mPriv->pacePending = false;
+	 if (mode == DEVICE_CLOSE) {
+	    TimerFree(mPriv->paceTimer);
+	    mPriv->paceTimer = NULL;
+	 }
+      }
+      if (mPriv->recoverTimer) {
+	 TimerCancel(mPriv->recoverTimer);
+	 if (mode == DEVICE_CLOSE) {
+	    TimerFree(mPriv->recoverTimer);
+	    mPriv->recoverTimer = NULL;
+	 }
+      }
+      /*
+       * The timer must not outlive the device; disable the host now,
+       * also when it was left enabled by PreInit.
+       */
+      if (mode == DEVICE_CLOSE) {
+	 if (mPriv->disableTimer) {
+	    TimerFree(mPriv->disableTimer);
+	    mPriv->disableTimer = NULL;
+	 }
+	 if (mPriv->enableTimer) {
+	    TimerCancel(mPriv->enableTimer);
+	    TimerFree(mPriv->enableTimer);
+	    mPriv->enableTimer = NULL;
+	 }
+	 if (mPriv->hostState == VMMOUSE_HOST_DISABLE_PENDING)
+	    VMMouseHostDisable(pInfo);
+	 if (mPriv->probeFd != -1) {
+	    xf86CloseSerial(mPriv->probeFd);
+	    mPriv->probeFd = -1;
+	 }
+      }
       if (pInfo->fd != -1) {
-	 VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+#ifdef __linux__
+	 /* The thread must not touch the backdoor past this point. */
+	 if (mPriv->threadRunning)
+	    VMMouseThreadStop(pInfo);
+#endif
+	 if (mPriv->hostState == VMMOUSE_HOST_ENABLE_PENDING) {
+	    TimerCancel(mPriv->enableTimer);
+	    mPriv->hostState = VMMOUSE_HOST_DISABLED;
+	 }
+	 /* DEVICE_ON starts over with a fresh read. */
+	 if (mPriv->recoverState != VMMOUSE_RECOVER_NONE) {
+	    mPriv->errorNsec += VMMouseNow() - mPriv->errorSince;
+	    mPriv->recoverState = VMMOUSE_RECOVER_NONE;
+	 }
 	 if( mPriv->vmmouseAvailable ) {
-	    VMMouseClient_Disable();
             mPriv->vmmouseAvailable = false;
-            mPriv->absoluteRequested = false;
+	    if (mode == DEVICE_OFF) {
+	       mPriv->hostState = VMMOUSE_HOST_DISABLE_PENDING;
+	       mPriv->disableTimer = TimerSet(mPriv->disableTimer, 0,
+					      VMMOUSE_DISABLE_DELAY,
+					      VMMouseDisableTimer, pInfo);
+	    } else {
+	       VMMouseHostDisable(pInfo);
+	    }
 	 }
+	 VMMouseLogStats(pInfo);
 
 	 xf86RemoveEnabledDevice(pInfo);
+#ifdef __linux__
+	 if (mPriv->wakeFd != -1) {
+	    close(mPriv->wakeFd);
+	    mPriv->wakeFd = -1;
+	    pInfo->fd = mPriv->ps2Fd;
+	 }
+#endif
 	 if (pMse->buffer) {
 	    XisbFree(pMse->buffer);
 	    pMse->buffer = NULL;
@@ -736,12 +1811,13 @@ VMMouseDeviceControl(DeviceIntPtr device, int mode)
 	 pInfo->fd = -1;
       }
       device->public.on = false;
-      usleep(300000);
+      xf86Msg(X_INFO, "VMWARE(0): DEVICE_%s took %llu us\n",
+	      mode == DEVICE_OFF ? "OFF" : "CLOSE",
+	      (unsigned long long)(VMMouseNow() - start) / 1000);
       break;
 
    case  DEVICE_ABORT:
       if (pInfo->fd != -1) {
-	 VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
 	 if( mPriv->vmmouseAvailable )
 	    VMMouseClient_Disable();
          break;
@@ -752,6 +1828,142 @@ VMMouseDeviceControl(DeviceIntPtr device, int mode)
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseHostDisable --
+ * 	Disable the host side of the device
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	Absolute mode has to be requested again after enabling
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseHostDisable(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+   VMMouseClient_Disable();
+   mPriv->hostState = VMMOUSE_HOST_DISABLED;
+   mPriv->absoluteRequested = false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseDisableTimer --
+ * 	Disable the host once the device has stayed off for
+ *	VMMOUSE_DISABLE_DELAY ms
+ *
+ * Results:
+ * 	0
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMouseDisableTimer(OsTimerPtr timer _X_UNUSED, CARD32 now _X_UNUSED, void *arg)
+{
+   InputInfoPtr pInfo = arg;
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   uint64_t start = VMMouseNow();
+
+   if (mPriv->hostState == VMMOUSE_HOST_DISABLE_PENDING) {
+      VMMouseHostDisable(pInfo);
+      LogMessageVerbSigSafe(X_INFO, -1, "VMWARE(0): deferred disable took %u us\n",
+			    (unsigned int)((VMMouseNow() - start) / 1000));
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseStartInput --
+ * 	Start reading the enabled host: the reader thread if configured,
+ *	then the server's watch on the device fd
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	pInfo->fd may be replaced by the reader thread's eventfd
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseStartInput(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+#ifdef __linux__
+   if (mPriv->readerThread && !VMMouseThreadStart(pInfo)) {
+      xf86Msg(X_WARNING, "%s: cannot start reader thread\n", pInfo->name);
+      mPriv->readerThread = false;
+   }
+#else
+   (void) mPriv;
+#endif
+   xf86AddEnabledDevice(pInfo);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseEnableTimer --
+ * 	Run the enable handshake left over by DEVICE_ON
+ *
+ * Results:
+ * 	0
+ *
+ * Side effects:
+ * 	The host is enabled and input starts, or the failure is logged
+ *	and the device stays silent until the next DEVICE_ON
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMouseEnableTimer(OsTimerPtr timer _X_UNUSED, CARD32 now _X_UNUSED, void *arg)
+{
+   InputInfoPtr pInfo = arg;
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   uint64_t start = VMMouseNow();
+
+   if (mPriv->hostState != VMMOUSE_HOST_ENABLE_PENDING)
+      return 0;
+
+   if (!VMMouseClient_Enable()) {
+      mPriv->hostState = VMMOUSE_HOST_DISABLED;
+      LogMessageVerbSigSafe(X_ERROR, -1, "VMWARE(0): vmmouse enable failed\n");
+      return 0;
+   }
+   mPriv->hostState = VMMOUSE_HOST_ENABLED;
+   mPriv->vmmouseAvailable = true;
+   xf86FlushInput(pInfo->fd);
+   VMMouseStartInput(pInfo);
+   LogMessageVerbSigSafe(X_INFO, -1, "VMWARE(0): deferred enable took %u us\n",
+			 (unsigned int)((VMMouseNow() - start) / 1000));
+   return 0;
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -775,12 +1987,25 @@ VMMouseReadInput(InputInfoPtr pInfo)
 {
    MouseDevPtr pMse;
    VMMousePrivPtr mPriv;
-   int c;
    int len = 0;
 
    pMse = pInfo->private;
    mPriv = pMse->mousePriv;
 
+   if (mPriv->latencyStats)
+      mPriv->latencyWakeup = VMMouseNow();
+
+#ifdef __linux__
+   if (mPriv->useEvdev) {
+      VMMouseEvdevReadInput(pInfo);
+      return;
+   }
+   if (mPriv->threadRunning) {
+      VMMouseThreadReadInput(pInfo);
+      return;
+   }
+#endif
+
    if (!mPriv->absoluteRequested) {
       /*
        * We can request for absolute mode, but it depends on
@@ -803,23 +2028,195 @@ VMMouseReadInput(InputInfoPtr pInfo)
     * read from blocking indefinitely.
     */
    XisbBlockDuration(pMse->buffer, -1);
-   while ((c = XisbRead(pMse->buffer)) >= 0) {
+   while (XisbRead(pMse->buffer) >= 0) {
       len++;
-      /*
-       * regular PS packet consists of 3 bytes
-       * We read 3 bytes to drain the PS/2 packet
-       */
-      if(len < 3) continue;
-      len = 0;
-      /*
-       * Now get the real data from absolute pointing device
-       */
-      GetVMMouseMotionEvent(pInfo);
    }
+
    /*
-    * There maybe still vmmouse data available
+    * The PS/2 bytes only notify us that the host queued packets; the
+    * actual data is read from the absolute pointing device in a single
+    * drain per wakeup. A drain per regular 3-byte PS/2 packet would
+    * mostly find the queue already empty; keep count of those.
     */
+   mPriv->drainsAvoided += len / 3;
    GetVMMouseMotionEvent(pInfo);
+
+   /*
+    * In poll mode the PS/2 notification only wakes the poll timer up;
+    * from then on the queue is polled until it stays empty.
+    */
+   if (mPriv->pollMode && mPriv->pollInterval == 0) {
+      mPriv->pollInterval = mPriv->pollMin;
+      mPriv->pollTimer = TimerSet(mPriv->pollTimer, 0, mPriv->pollInterval,
+				  VMMousePollTimer, pInfo);
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMousePollTimer --
+ * 	Poll the host queue. The interval is reset to the minimum
+ *	whenever packets arrive and doubles on every empty poll. Past
+ *	the maximum interval the timer stops until the next PS/2
+ *	notification, so an idle pointer causes no wakeups.
+ *
+ * Results:
+ * 	The next interval in milliseconds, 0 to stop polling
+ *
+ * Side effects:
+ * 	Queued packets are posted
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMousePollTimer(OsTimerPtr timer _X_UNUSED, CARD32 now _X_UNUSED, void *arg)
+{
+   InputInfoPtr pInfo = arg;
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+   if (!mPriv->vmmouseAvailable) {
+      mPriv->pollInterval = 0;
+      return 0;
+   }
+
+   mPriv->polls++;
+   if (mPriv->latencyStats)
+      mPriv->latencyWakeup = VMMouseNow();
+
+   if (GetVMMouseMotionEvent(pInfo) > 0)
+      mPriv->pollInterval = mPriv->pollMin;
+   else if (mPriv->pollInterval * 2 <= mPriv->pollMax)
+      mPriv->pollInterval *= 2;
+   else
+      mPriv->pollInterval = 0;
+
+   return mPriv->pollInterval;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseRecoverBegin --
+ * 	Note a VMMOUSE_ERROR from the host and pick the delay before the
+ *	reset. Consecutive errors keep the backoff reached by the previous
+ *	reset; a good read clears it.
+ *
+ * Results:
+ * 	The delay in ms, or 0 if a reset is already pending
+ *
+ * Side effects:
+ * 	Enters VMMOUSE_RECOVER_PENDING
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMouseRecoverBegin(VMMousePrivPtr mPriv)
+{
+   if (mPriv->recoverState == VMMOUSE_RECOVER_PENDING)
+      return 0;
+
+   mPriv->recoverState = VMMOUSE_RECOVER_PENDING;
+   mPriv->errorSince = VMMouseNow();
+   if (!mPriv->recoverDelay)
+      mPriv->recoverDelay = VMMOUSE_RECOVER_MIN;
+   LogMessageVerbSigSafe(X_INFO, -1, "VMWARE(0): host error, resetting in %u ms\n",
+			 (unsigned int)mPriv->recoverDelay);
+   return mPriv->recoverDelay;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseRecoverReset --
+ * 	Reset the host once the recovery delay has passed, unless the
+ *	per-second reset cap has been reached.
+ *
+ * Results:
+ * 	0 if the host is back, otherwise the ms to wait before the next
+ *	attempt
+ *
+ * Side effects:
+ * 	Disables, re-enables and re-requests absolute mode on the host
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMouseRecoverReset(VMMousePrivPtr mPriv)
+{
+   uint64_t now = VMMouseNow();
+   bool enabled;
+
+   if (now - mPriv->recoverWindow >= 1000000000ULL) {
+      mPriv->recoverWindow = now;
+      mPriv->recoverWindowResets = 0;
+   }
+   if (mPriv->recoverWindowResets >= VMMOUSE_RECOVER_PER_SEC) {
+      mPriv->resetsThrottled++;
+      return (CARD32)((mPriv->recoverWindow + 1000000000ULL - now) / 1000000) + 1;
+   }
+
+   mPriv->recoverWindowResets++;
+   mPriv->resets++;
+   VMMouseClient_Disable();
+   enabled = VMMouseClient_Enable();
+   if (enabled)
+      VMMouseClient_RequestAbsolute();
+
+   mPriv->recoverDelay *= 2;
+   if (mPriv->recoverDelay > VMMOUSE_RECOVER_MAX)
+      mPriv->recoverDelay = VMMOUSE_RECOVER_MAX;
+   if (!enabled)
+      return mPriv->recoverDelay;
+
+   now = VMMouseNow();
+   mPriv->errorNsec += now - mPriv->errorSince;
+   mPriv->recoverState = VMMOUSE_RECOVER_NONE;
+   LogMessageVerbSigSafe(X_INFO, -1, "VMWARE(0): re-requesting absolute mode after reset\n");
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseRecoverTimer --
+ * 	Retry the host reset from the server's timer
+ *
+ * Results:
+ * 	0 once the host is back, otherwise the delay until the next try
+ *
+ * Side effects:
+ * 	See VMMouseRecoverReset
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMouseRecoverTimer(OsTimerPtr timer _X_UNUSED, CARD32 now _X_UNUSED, void *arg)
+{
+   InputInfoPtr pInfo = arg;
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+   CARD32 delay;
+
+   if (!mPriv->vmmouseAvailable)
+      return 0;
+   delay = VMMouseRecoverReset(mPriv);
+#ifdef __linux__
+   /* The reader thread picks up again on its next poll. */
+   if (!delay && mPriv->threadRunning)
+      __atomic_store_n(&mPriv->threadError, false, __ATOMIC_RELEASE);
+#endif
+   return delay;
 }
 
 
@@ -828,10 +2225,14 @@ VMMouseReadInput(InputInfoPtr pInfo)
  *
  * GetVMMouseMotionEvent --
  * 	Read all the mouse data available from the absolute
- * 	pointing device	and post it to the Xserver
+ * 	pointing device	and post it to the Xserver. The host queue
+ * 	is drained in batches, querying the status only once per
+ * 	batch. When a drain budget is configured and runs out, the
+ * 	rest of the queue is left to a timer so that other input
+ * 	devices get a turn.
  *
  * Results:
- * 	None
+ * 	The number of packets read
  *
  * Side effects:
  *	Real mouse data was read from the absolute pointing
@@ -840,52 +2241,1164 @@ VMMouseReadInput(InputInfoPtr pInfo)
  *----------------------------------------------------------------------
  */
 
-static void
+static unsigned int
 GetVMMouseMotionEvent(InputInfoPtr pInfo){
-   MouseDevPtr pMse;
-   VMMousePrivPtr mPriv;
-   int buttons, dx, dy, dz, dw;
-   VMMOUSE_INPUT_DATA  vmmouseInput;
-   int numPackets;
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   VMMOUSE_INPUT_DATA  vmmouseInput[VMMOUSE_DRAIN_PACKETS];
+   unsigned int numPackets, maxPackets;
+   unsigned int total = 0;
+   uint64_t start = mPriv->budgetNsec ? VMMouseNow() : 0;
+   CARD32 delay;
+
+   /* The host is left alone until the recovery timer resets it. */
+   if (mPriv->recoverState != VMMOUSE_RECOVER_NONE)
+      return 0;
+
+   do {
+      maxPackets = VMMOUSE_DRAIN_PACKETS;
+      if (mPriv->budgetPackets) {
+         if (total >= mPriv->budgetPackets)
+            goto exhausted;
+         if (mPriv->budgetPackets - total < maxPackets)
+            maxPackets = mPriv->budgetPackets - total;
+      }
+      if (mPriv->budgetNsec && total && VMMouseNow() - start >= mPriv->budgetNsec)
+         goto exhausted;
 
-   pMse = pInfo->private;
-   mPriv = (VMMousePrivPtr)pMse->mousePriv;
-   while((numPackets = VMMouseClient_GetInput(&vmmouseInput))){
-      int ps2Buttons = 0;
+      numPackets = VMMouseClient_GetInputBatch(vmmouseInput, maxPackets);
+      VMMouseReportDiscarded();
       if (numPackets == VMMOUSE_ERROR) {
-         VMMouseClient_Disable();
-         VMMouseClient_Enable();
-         VMMouseClient_RequestAbsolute();
-         LogMessageVerbSigSafe(X_INFO, -1, "VMWARE(0): re-requesting absolute mode after reset\n");
+         delay = VMMouseRecoverBegin(mPriv);
+         if (delay)
+            mPriv->recoverTimer = TimerSet(mPriv->recoverTimer, 0, delay,
+                                           VMMouseRecoverTimer, pInfo);
          break;
       }
+      mPriv->recoverDelay = 0;
 
-      if(vmmouseInput.Buttons & VMMOUSE_MIDDLE_BUTTON)
-	 ps2Buttons |= 0x04; 			/* Middle*/
-      if(vmmouseInput.Buttons & VMMOUSE_RIGHT_BUTTON)
-	 ps2Buttons |= 0x02; 			/* Right*/
-      if(vmmouseInput.Buttons & VMMOUSE_LEFT_BUTTON)
-	 ps2Buttons |= 0x01; 			/* Left*/
-
-      buttons = (ps2Buttons & 0x04) >> 1 |	/* Middle */
-	 (ps2Buttons & 0x02) >> 1 |       	/* Right */
-	 (ps2Buttons & 0x01) << 2;       	/* Left */
-
-      dx = vmmouseInput.X;
-      dy = vmmouseInput.Y;
-      dz = (char)vmmouseInput.Z;
-      dw = 0;
+      total += numPackets;
+      VMMousePostBatch(pInfo, vmmouseInput, numPackets);
       /*
-       * Get the per package relative or absolute information.
+       * A full batch means the host may have more packets queued.
        */
-      mPriv->isCurrRelative = vmmouseInput.Flags & VMMOUSE_MOVE_RELATIVE;
-      /* post an event */
-      pMse->PostEvent(pInfo, buttons, dx, dy, dz, dw);
-      mPriv->vmmousePrevInput = vmmouseInput;
+   } while (numPackets == maxPackets);
+
+   return total;
+
+exhausted:
+   /* A 0 ms timer would be disarmed; 1 ms is the shortest delay. */
+   mPriv->budgetExhausted++;
+   mPriv->drainTimer = TimerSet(mPriv->drainTimer, 0, 1,
+                                VMMouseDrainTimer, pInfo);
+   return total;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseDrainTimer --
+ * 	Continue a drain that ran out of budget
+ *
+ * Results:
+ * 	0, the timer is re-armed if the budget runs out again
+ *
+ * Side effects:
+ * 	Queued packets are posted
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMouseDrainTimer(OsTimerPtr timer _X_UNUSED, CARD32 now _X_UNUSED, void *arg)
+{
+   InputInfoPtr pInfo = arg;
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+   if (mPriv->vmmouseAvailable) {
+      if (mPriv->latencyStats)
+	 mPriv->latencyWakeup = VMMouseNow();
+      GetVMMouseMotionEvent(pInfo);
+   }
+   return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseSimTimer --
+ * 	Drain the simulated host, which has no PS/2 notifications
+ *
+ * Results:
+ * 	VMMOUSE_SIM_INTERVAL, to keep polling
+ *
+ * Side effects:
+ * 	Queued packets are posted
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CARD32
+VMMouseSimTimer(OsTimerPtr timer _X_UNUSED, CARD32 now _X_UNUSED, void *arg)
+{
+   InputInfoPtr pInfo = arg;
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+   if (!mPriv->vmmouseAvailable)
+      return 0;
+
+   if (!mPriv->absoluteRequested) {
+      VMMouseClient_RequestAbsolute();
+      mPriv->absoluteRequested = true;
+   }
+   if (mPriv->latencyStats)
+      mPriv->latencyWakeup = VMMouseNow();
+   GetVMMouseMotionEvent(pInfo);
+   return VMMOUSE_SIM_INTERVAL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseReportDiscarded --
+ * 	Warn about the words the client dropped while realigning
+ *	the host queue. Safe from timers and the reader thread.
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseReportDiscarded(void)
+{
+   uint32_t words = VMMouseClient_TakeDiscarded();
+
+   if (words)
+      LogMessageVerbSigSafe(X_WARNING, -1,
+                            "VMWARE(0): host queue misaligned, discarded %u words\n",
+                            words);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMousePostBatch --
+ * 	Post a batch of packets, coalescing them first if enabled
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	packets may be rewritten
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMousePostBatch(InputInfoPtr pInfo, PVMMOUSE_INPUT_DATA packets,
+                 unsigned int numPackets)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   unsigned int i;
+
+   if (mPriv->coalesce)
+      numPackets = VMMouseCoalesce(pInfo, packets, numPackets);
+
+   for (i = 0; i < numPackets; i++)
+      VMMouseProcessPacket(pInfo, &packets[i]);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseCoalesce --
+ * 	Merge runs of motion-only packets in place, see
+ *	VMMouseClient_Coalesce, and count what was merged
+ *
+ * Results:
+ * 	The number of packets left in the array
+ *
+ * Side effects:
+ * 	packets is rewritten
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+VMMouseCoalesce(InputInfoPtr pInfo, PVMMOUSE_INPUT_DATA packets,
+                unsigned int numPackets)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   unsigned int out;
+
+   out = VMMouseClient_Coalesce(packets, numPackets);
+   mPriv->packetsCoalesced += numPackets - out;
+   return out;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseSetScreenMap --
+ * 	Compute the map that sends the full host coordinate range to
+ *	the given rectangle of the desktop
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseSetScreenMap(VMMouseScreenMap *m, int x, int y, int width, int height)
+{
+   int64_t dw = screenInfo.width > 0 ? screenInfo.width : 1;
+   int64_t dh = screenInfo.height > 0 ? screenInfo.height : 1;
+
+   m->xScale = ((int64_t)width << 16) / dw;
+   m->xOffset = ((int64_t)(x - screenInfo.x) << 32) / dw;
+   m->yScale = ((int64_t)height << 16) / dh;
+   m->yOffset = ((int64_t)(y - screenInfo.y) << 32) / dh;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseUpdateScreenMap --
+ * 	Rebuild the map for the configured screen or RandR output when
+ *	the desktop layout has changed. Runs on the main thread only,
+ *	since it walks the screens and RandR outputs; the result is
+ *	published to the input thread under input_lock().
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	mPriv->screenMap may be replaced
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseUpdateScreenMap(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   VMMouseLayout layout;
+   VMMouseScreenMap map;
+   bool mapped = false;
+
+   memset(&layout, 0, sizeof(layout));
+   layout.generation = serverGeneration;
+   layout.numScreens = screenInfo.numScreens;
+   layout.width = screenInfo.width;
+   layout.height = screenInfo.height;
+#ifdef RANDR
+   if (layout.numScreens > 0 && dixPrivateKeyRegistered(rrPrivKey)) {
+      rrScrPrivPtr pScrPriv = rrGetScrPriv(screenInfo.screens[0]);
+
+      if (pScrPriv) {
+	 layout.rrSetTime = pScrPriv->lastSetTime.milliseconds;
+	 layout.rrConfigTime = pScrPriv->lastConfigTime.milliseconds;
+      }
+   }
+#endif
+
+   if (!memcmp(&layout, &mPriv->layout, sizeof(layout)))
+      return;
+   mPriv->layout = layout;
+
+   if (mPriv->screenNum >= 0 && mPriv->screenNum < screenInfo.numScreens) {
+      ScreenPtr pScreen = screenInfo.screens[mPriv->screenNum];
+
+      VMMouseSetScreenMap(&map, pScreen->x, pScreen->y,
+			  pScreen->width, pScreen->height);
+      mapped = true;
+   }
+
+#ifdef RANDR
+   if (mPriv->output && screenInfo.numScreens > 0 &&
+       dixPrivateKeyRegistered(rrPrivKey)) {
+      rrScrPrivPtr pScrPriv = rrGetScrPriv(screenInfo.screens[0]);
+      int i;
+
+      for (i = 0; pScrPriv && i < pScrPriv->numOutputs; i++) {
+	 RROutputPtr output = pScrPriv->outputs[i];
+	 RRCrtcPtr crtc = output->crtc;
+	 int width, height;
+
+	 if (strcmp(output->name, mPriv->output) || !crtc || !crtc->mode)
+	    continue;
+
+	 width = crtc->mode->mode.width;
+	 height = crtc->mode->mode.height;
+	 if (crtc->rotation & (RR_Rotate_90 | RR_Rotate_270)) {
+	    width = crtc->mode->mode.height;
+	    height = crtc->mode->mode.width;
+	 }
+	 VMMouseSetScreenMap(&map, crtc->x, crtc->y, width, height);
+	 mapped = true;
+	 break;
+      }
    }
+#endif
+
+   input_lock();
+   if (mapped)
+      mPriv->screenMap = map;
+   mPriv->screenMapped = mapped;
+   input_unlock();
+
+   xf86Msg(X_INFO, "VMWARE(0): desktop layout changed, absolute mapping %s\n",
+	   mapped ? "updated" : "covers the desktop");
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseBlockHandler --
+ * 	Pick up desktop layout changes before the server sleeps
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	See VMMouseUpdateScreenMap
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseBlockHandler(void *data, void *timeout _X_UNUSED)
+{
+   VMMouseUpdateScreenMap(data);
 }
 
 
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseProcessPacket --
+ * 	Translate one VMMouse packet and post it to the Xserver
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ *	The packet becomes the previous input
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseProcessPacket(InputInfoPtr pInfo, PVMMOUSE_INPUT_DATA pInput)
+{
+   MouseDevPtr pMse;
+   VMMousePrivPtr mPriv;
+   VMMouseAxisXform *t;
+   VMMOUSE_INPUT_DATA input = *pInput;
+   int x, y;
+
+   pMse = pInfo->private;
+   mPriv = (VMMousePrivPtr)pMse->mousePriv;
+
+   if (mPriv->latencyStats) {
+      mPriv->latencyDecode = VMMouseNow();
+      VMMouseLatencyRecord(mPriv, VMMOUSE_LATENCY_DECODE,
+			   mPriv->latencyWakeup, mPriv->latencyDecode);
+   }
+
+   /*
+    * Get the per package relative or absolute information.
+    */
+   mPriv->isCurrRelative = !!(pInput->Flags & VMMOUSE_MOVE_RELATIVE);
+
+   t = &mPriv->xform[mPriv->isCurrRelative];
+   x = t->swap ? pInput->Y : pInput->X;
+   y = t->swap ? pInput->X : pInput->Y;
+   input.X = x * t->xScale + t->xOffset;
+   input.Y = y * t->yScale + t->yOffset;
+
+   if (!mPriv->isCurrRelative && mPriv->screenMapped) {
+      VMMouseScreenMap m = mPriv->screenMap;
+
+      input.X = (input.X * m.xScale + m.xOffset) >> 16;
+      input.Y = (input.Y * m.yScale + m.yOffset) >> 16;
+   }
+
+   /* post an event */
+   pMse->PostEvent(pInfo,
+		   mPriv->buttonMap[VMMOUSE_BUTTON_INDEX(pInput->Buttons)],
+		   input.X, input.Y, (char)pInput->Z, 0);
+   mPriv->vmmousePrevInput = input;
+}
+
+
+#ifdef __linux__
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseEvdevFind --
+ * 	Look up the event devices of the kernel vmmouse driver in sysfs
+ *
+ * Results:
+ * 	The number of device nodes stored in paths
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+VMMouseEvdevFind(char paths[][PATH_MAX])
+{
+   DIR *dir;
+   struct dirent *ent;
+   int num = 0;
+
+   dir = opendir("/sys/class/input");
+   if (!dir)
+      return 0;
+
+   while (num < VMMOUSE_EVDEV_MAX && (ent = readdir(dir))) {
+      char path[PATH_MAX];
+      char name[128];
+      FILE *f;
+
+      if (strncmp(ent->d_name, "event", 5))
+	 continue;
+
+      snprintf(path, sizeof(path), "/sys/class/input/%s/device/name",
+	       ent->d_name);
+      f = fopen(path, "r");
+      if (!f)
+	 continue;
+      if (fgets(name, sizeof(name), f)) {
+	 name[strcspn(name, "\n")] = '\0';
+	 if (!strcmp(name, VMMOUSE_KERNEL_DEVNAME))
+	    snprintf(paths[num++], PATH_MAX, "/dev/input/%s", ent->d_name);
+      }
+      fclose(f);
+   }
+   closedir(dir);
+
+   return num;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseEvdevOpen --
+ * 	Open the kernel vmmouse event devices and multiplex them on an
+ *	epoll descriptor that becomes the device fd
+ *
+ * Results:
+ * 	true if at least one device could be opened
+ *
+ * Side effects:
+ * 	pInfo->fd is set
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+VMMouseEvdevOpen(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   char paths[VMMOUSE_EVDEV_MAX][PATH_MAX];
+   int num, i;
+
+   num = VMMouseEvdevFind(paths);
+   mPriv->evdevNum = 0;
+
+   pInfo->fd = epoll_create1(EPOLL_CLOEXEC);
+   if (pInfo->fd == -1)
+      return false;
+
+   for (i = 0; i < num; i++) {
+      VMMouseEvdevPtr ev = &mPriv->evdev[mPriv->evdevNum];
+      unsigned long evbits = 0;
+      struct input_absinfo absinfo;
+      struct epoll_event epev;
+
+      memset(ev, 0, sizeof(*ev));
+      ev->fd = open(paths[i], O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+      if (ev->fd == -1) {
+	 xf86Msg(X_WARNING, "%s: cannot open %s: %s\n", pInfo->name,
+		 paths[i], strerror(errno));
+	 continue;
+      }
+
+      if (ioctl(ev->fd, EVIOCGBIT(0, sizeof(evbits)), &evbits) >= 0)
+	 ev->absolute = !!(evbits & (1UL << EV_ABS));
+      if (ev->absolute) {
+	 if (ioctl(ev->fd, EVIOCGABS(ABS_X), &absinfo) >= 0)
+	    ev->x = absinfo.value;
+	 if (ioctl(ev->fd, EVIOCGABS(ABS_Y), &absinfo) >= 0)
+	    ev->y = absinfo.value;
+      }
+
+      /*
+       * A grab hides the device from every other reader, including
+       * other X input devices and sessions on other VTs, so it is
+       * opt-in.
+       */
+      if (mPriv->evdevGrab && ioctl(ev->fd, EVIOCGRAB, (void *)1) == -1)
+	 xf86Msg(X_WARNING, "%s: cannot grab %s: %s\n", pInfo->name,
+		 paths[i], strerror(errno));
+
+      memset(&epev, 0, sizeof(epev));
+      epev.events = EPOLLIN;
+      epev.data.u32 = mPriv->evdevNum;
+      if (epoll_ctl(pInfo->fd, EPOLL_CTL_ADD, ev->fd, &epev) == -1) {
+	 close(ev->fd);
+	 continue;
+      }
+
+      xf86Msg(X_INFO, "%s: reading %s device %s\n", pInfo->name,
+	      ev->absolute ? "absolute" : "relative", paths[i]);
+      mPriv->evdevNum++;
+   }
+
+   if (mPriv->evdevNum == 0) {
+      close(pInfo->fd);
+      pInfo->fd = -1;
+      return false;
+   }
+
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseEvdevClose --
+ * 	Stop reading the kernel vmmouse event devices
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	pInfo->fd is closed
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseEvdevClose(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   int i;
+
+   if (pInfo->fd == -1)
+      return;
+
+   xf86RemoveEnabledDevice(pInfo);
+   for (i = 0; i < mPriv->evdevNum; i++)
+      close(mPriv->evdev[i].fd);
+   mPriv->evdevNum = 0;
+   close(pInfo->fd);
+   pInfo->fd = -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseEvdevSync --
+ * 	Reload the button and position state of an event device after
+ *	the kernel dropped events
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	A packet with the current state is due on the next SYN_REPORT
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseEvdevSync(VMMouseEvdevPtr ev)
+{
+   unsigned char keys[KEY_MAX / 8 + 1];
+   struct input_absinfo absinfo;
+
+   memset(keys, 0, sizeof(keys));
+   if (ioctl(ev->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0) {
+#define VMMOUSE_KEY_DOWN(code)	(keys[(code) / 8] & (1 << ((code) % 8)))
+      ev->buttons = 0;
+      if (VMMOUSE_KEY_DOWN(BTN_LEFT))
+	 ev->buttons |= VMMOUSE_LEFT_BUTTON;
+      if (VMMOUSE_KEY_DOWN(BTN_RIGHT))
+	 ev->buttons |= VMMOUSE_RIGHT_BUTTON;
+      if (VMMOUSE_KEY_DOWN(BTN_MIDDLE))
+	 ev->buttons |= VMMOUSE_MIDDLE_BUTTON;
+#undef VMMOUSE_KEY_DOWN
+   }
+   if (ev->absolute) {
+      if (ioctl(ev->fd, EVIOCGABS(ABS_X), &absinfo) >= 0)
+	 ev->x = absinfo.value;
+      if (ioctl(ev->fd, EVIOCGABS(ABS_Y), &absinfo) >= 0)
+	 ev->y = absinfo.value;
+   }
+   ev->dx = ev->dy = ev->dz = 0;
+   ev->pending = true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseEvdevReadInput --
+ * 	Read batches of input events from the kernel vmmouse devices,
+ *	turn each SYN_REPORT frame into a VMMouse packet and post it
+ *	through the regular packet path
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	The event devices are drained
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseEvdevReadInput(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   struct input_event events[64];
+   VMMOUSE_INPUT_DATA packets[VMMOUSE_DRAIN_PACKETS];
+   unsigned int numPackets = 0;
+   unsigned int total = 0;
+   uint64_t start = mPriv->budgetNsec ? VMMouseNow() : 0;
+   int j, d, i;
+
+   for (j = 0; j < mPriv->evdevNum; j++) {
+      VMMouseEvdevPtr ev;
+      ssize_t len;
+
+      d = (mPriv->evdevNext + j) % mPriv->evdevNum;
+      ev = &mPriv->evdev[d];
+
+      for (;;) {
+	 int n;
+
+	 /*
+	  * The epoll fd stays readable while events are left, so the
+	  * server comes back to them after serving the other devices.
+	  * The device that ran out of budget is read first next time.
+	  */
+	 if ((mPriv->budgetPackets && total >= mPriv->budgetPackets) ||
+	     (mPriv->budgetNsec && total &&
+	      VMMouseNow() - start >= mPriv->budgetNsec)) {
+	    mPriv->budgetExhausted++;
+	    mPriv->evdevNext = d;
+	    goto out;
+	 }
+
+	 len = read(ev->fd, events, sizeof(events));
+	 if (len <= 0)
+	    break;
+	 n = len / sizeof(struct input_event);
+
+	 for (i = 0; i < n; i++) {
+	    struct input_event *e = &events[i];
+	    int bit = 0;
+
+	    /*
+	     * After SYN_DROPPED everything up to the next SYN_REPORT is
+	     * incomplete; the state is read back from the device there.
+	     */
+	    if (ev->dropped) {
+	       if (e->type == EV_SYN && e->code == SYN_REPORT) {
+		  ev->dropped = false;
+		  VMMouseEvdevSync(ev);
+	       } else {
+		  continue;
+	       }
+	    }
+
+	    switch (e->type) {
+	    case EV_ABS:
+	       if (e->code == ABS_X)
+		  ev->x = e->value;
+	       else if (e->code == ABS_Y)
+		  ev->y = e->value;
+	       ev->pending = true;
+	       break;
+	    case EV_REL:
+	       if (e->code == REL_X)
+		  ev->dx += e->value;
+	       else if (e->code == REL_Y)
+		  ev->dy += e->value;
+	       else if (e->code == REL_WHEEL)
+		  ev->dz -= e->value;	/* VMMouse Z is inverted */
+	       ev->pending = true;
+	       break;
+	    case EV_KEY:
+	       if (e->code == BTN_LEFT)
+		  bit = VMMOUSE_LEFT_BUTTON;
+	       else if (e->code == BTN_RIGHT)
+		  bit = VMMOUSE_RIGHT_BUTTON;
+	       else if (e->code == BTN_MIDDLE)
+		  bit = VMMOUSE_MIDDLE_BUTTON;
+	       if (e->value)
+		  ev->buttons |= bit;
+	       else
+		  ev->buttons &= ~bit;
+	       ev->pending = true;
+	       break;
+	    case EV_SYN:
+	       if (e->code == SYN_REPORT && ev->pending) {
+		  PVMMOUSE_INPUT_DATA p = &packets[numPackets++];
+		  int k;
+
+		  /*
+		   * The kernel reports each button on the device that was
+		   * current when it was pressed.
+		   */
+		  p->Buttons = 0;
+		  for (k = 0; k < mPriv->evdevNum; k++)
+		     p->Buttons |= mPriv->evdev[k].buttons;
+		  if (ev->absolute) {
+		     p->Flags = VMMOUSE_MOVE_ABSOLUTE;
+		     p->X = ev->x;
+		     p->Y = ev->y;
+		  } else {
+		     p->Flags = VMMOUSE_MOVE_RELATIVE;
+		     p->X = ev->dx;
+		     p->Y = ev->dy;
+		  }
+		  p->Z = ev->dz;
+		  ev->dx = ev->dy = ev->dz = 0;
+		  ev->pending = false;
+		  total++;
+
+		  if (numPackets == VMMOUSE_DRAIN_PACKETS) {
+		     VMMousePostBatch(pInfo, packets, numPackets);
+		     numPackets = 0;
+		  }
+	       } else if (e->code == SYN_DROPPED) {
+		  ev->dropped = true;
+		  ev->pending = false;
+	       }
+	       break;
+	    }
+	 }
+      }
+   }
+
+out:
+   VMMousePostBatch(pInfo, packets, numPackets);
+}
+#endif
+
+
+#ifdef __linux__
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseEventfdSignal --
+ * 	Add one to an eventfd counter
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	Wakes up the reader of fd. EAGAIN means the counter is already
+ *	saturated, so the reader is due to wake up anyway.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseEventfdSignal(int fd)
+{
+   uint64_t one = 1;
+
+   while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+      ;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseRingPut --
+ * 	Queue a packet for the server if more than reserve slots are
+ *	free
+ *
+ * Results:
+ * 	true if the packet was queued
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+VMMouseRingPut(VMMouseRing *ring, const VMMOUSE_INPUT_DATA *packet,
+	       unsigned int reserve)
+{
+   unsigned int head = ring->head;
+   unsigned int tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+   if (head - tail + reserve >= VMMOUSE_RING_SIZE)
+      return false;
+   ring->packets[head & (VMMOUSE_RING_SIZE - 1)] = *packet;
+   __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseRingPutWait --
+ * 	Queue a packet that must not be lost, waiting for the server
+ *	to make room
+ *
+ * Results:
+ * 	false if the thread was asked to stop first
+ *
+ * Side effects:
+ * 	Wakes the server while waiting
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+VMMouseRingPutWait(VMMousePrivPtr mPriv, const VMMOUSE_INPUT_DATA *packet)
+{
+   struct pollfd stop = { mPriv->stopFd, POLLIN, 0 };
+
+   while (!VMMouseRingPut(&mPriv->ring, packet, 0)) {
+      VMMouseEventfdSignal(mPriv->wakeFd);
+      if (poll(&stop, 1, 1) > 0)
+	 return false;
+   }
+   return true;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseReaderThread --
+ * 	Wait for PS/2 notifications, drain the host queue into the ring
+ *	and wake the server through the eventfd. Keeps the backdoor
+ *	exits off the server's input path.
+ *
+ *	The thread never touches the recovery state: on VMMOUSE_ERROR it
+ *	flags threadError, wakes the server and leaves the host alone
+ *	until the server's recovery timer has reset it and cleared the
+ *	flag.
+ *
+ *	When the ring is nearly full, motion-only packets are merged
+ *	into one held packet instead of being queued. Button and wheel
+ *	changes, and the motion held before them, are never dropped;
+ *	the thread waits for room instead, while the host queue buffers.
+ *
+ * Results:
+ * 	NULL
+ *
+ * Side effects:
+ * 	Owns the backdoor while running and threadError is clear
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void *
+VMMouseReaderThread(void *arg)
+{
+   InputInfoPtr pInfo = arg;
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   VMMOUSE_INPUT_DATA batch[VMMOUSE_DRAIN_PACKETS];
+   VMMOUSE_INPUT_DATA held;		/* merged motion not yet queued */
+   bool haveHeld = false;
+   unsigned short lastButtons = 0;
+   struct pollfd fds[2];
+   unsigned char buf[64];
+   unsigned int numPackets, i;
+   int timeout;
+   int ret;
+
+   fds[0].fd = mPriv->ps2Fd;
+   fds[0].events = POLLIN;
+   fds[1].fd = mPriv->stopFd;
+   fds[1].events = POLLIN;
+
+   for (;;) {
+      bool paused = __atomic_load_n(&mPriv->threadError, __ATOMIC_ACQUIRE);
+      bool queued = false;
+
+      /* Look again for the end of a pause or room for held motion. */
+      timeout = -1;
+      if (paused)
+	 timeout = VMMOUSE_RECOVER_MIN;
+      else if (haveHeld)
+	 timeout = 1;
+      ret = poll(fds, 2, timeout);
+      if (ret < 0) {
+	 if (errno == EINTR)
+	    continue;
+	 break;
+      }
+      if (fds[1].revents)
+	 break;
+
+      while (read(mPriv->ps2Fd, buf, sizeof(buf)) > 0)
+	 ;
+
+      if (__atomic_load_n(&mPriv->threadError, __ATOMIC_ACQUIRE))
+	 continue;
+
+      do {
+	 numPackets = VMMouseClient_GetInputBatch(batch,
+						  VMMOUSE_DRAIN_PACKETS);
+	 VMMouseReportDiscarded();
+	 if (numPackets == VMMOUSE_ERROR) {
+	    __atomic_store_n(&mPriv->threadError, true, __ATOMIC_RELEASE);
+	    queued = true;
+	    break;
+	 }
+
+	 for (i = 0; i < numPackets; i++) {
+	    PVMMOUSE_INPUT_DATA p = &batch[i];
+	    bool motion = p->Buttons == lastButtons && p->Z == 0 &&
+	       (!haveHeld || (held.Flags & VMMOUSE_MOVE_RELATIVE) ==
+		(p->Flags & VMMOUSE_MOVE_RELATIVE));
+
+	    lastButtons = p->Buttons;
+	    if (motion) {
+	       if (!haveHeld) {
+		  held = *p;
+		  haveHeld = true;
+	       } else {
+		  if (p->Flags & VMMOUSE_MOVE_RELATIVE) {
+		     held.X += p->X;
+		     held.Y += p->Y;
+		  } else {
+		     held.X = p->X;
+		     held.Y = p->Y;
+		  }
+		  mPriv->ringOverflows++;
+	       }
+	       if (VMMouseRingPut(&mPriv->ring, &held, VMMOUSE_RING_RESERVE)) {
+		  haveHeld = false;
+		  queued = true;
+	       }
+	       continue;
+	    }
+
+	    if (haveHeld) {
+	       if (!VMMouseRingPutWait(mPriv, &held))
+		  return NULL;
+	       haveHeld = false;
+	    }
+	    if (!VMMouseRingPutWait(mPriv, p))
+	       return NULL;
+	    queued = true;
+	 }
+      } while (numPackets == VMMOUSE_DRAIN_PACKETS);
+
+      if (haveHeld && VMMouseRingPut(&mPriv->ring, &held, 0)) {
+	 haveHeld = false;
+	 queued = true;
+      }
+      if (queued)
+	 VMMouseEventfdSignal(mPriv->wakeFd);
+   }
+
+   return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseThreadStart --
+ * 	Start the reader thread on the open PS/2 fd. The server then
+ *	watches an eventfd instead of the PS/2 fd.
+ *
+ * Results:
+ * 	true if the thread is running
+ *
+ * Side effects:
+ * 	pInfo->fd is replaced by the eventfd
+ *
+ *----------------------------------------------------------------------
+ */
+
+static bool
+VMMouseThreadStart(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   sigset_t all, saved;
+   int ret;
+
+   mPriv->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   mPriv->stopFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (mPriv->wakeFd == -1 || mPriv->stopFd == -1)
+      goto error;
+
+   mPriv->ps2Fd = pInfo->fd;
+   fcntl(mPriv->ps2Fd, F_SETFL, fcntl(mPriv->ps2Fd, F_GETFL) | O_NONBLOCK);
+   mPriv->ring.head = mPriv->ring.tail = 0;
+   mPriv->threadError = false;
+
+   /* As GetVMMouseMotionEvent would, before the thread owns the host. */
+   if (!mPriv->absoluteRequested) {
+      VMMouseClient_RequestAbsolute();
+      mPriv->absoluteRequested = true;
+      xf86Msg(X_INFO, "VMWARE(0): vmmouse enable absolute mode\n");
+   }
+
+   /*
+    * Like the server's input thread, never take signals such as
+    * SIGIO or SIGALRM on the reader thread.
+    */
+   sigfillset(&all);
+   pthread_sigmask(SIG_SETMASK, &all, &saved);
+   ret = pthread_create(&mPriv->thread, NULL, VMMouseReaderThread, pInfo);
+   pthread_sigmask(SIG_SETMASK, &saved, NULL);
+   if (ret)
+      goto error;
+
+   mPriv->threadRunning = true;
+   pInfo->fd = mPriv->wakeFd;
+   xf86Msg(X_INFO, "%s: reading the backdoor from a separate thread\n",
+	   pInfo->name);
+   return true;
+
+error:
+   if (mPriv->wakeFd != -1)
+      close(mPriv->wakeFd);
+   if (mPriv->stopFd != -1)
+      close(mPriv->stopFd);
+   mPriv->wakeFd = mPriv->stopFd = -1;
+   return false;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseThreadStop --
+ * 	Stop the reader thread and wait for it. The eventfd stays
+ *	registered as pInfo->fd until the caller removes the device.
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	None
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseThreadStop(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   VMMouseEventfdSignal(mPriv->stopFd);
+   pthread_join(mPriv->thread, NULL);
+   mPriv->threadRunning = false;
+   close(mPriv->stopFd);
+   mPriv->stopFd = -1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * VMMouseThreadReadInput --
+ * 	Post the packets the reader thread queued in the ring
+ *
+ * Results:
+ * 	None
+ *
+ * Side effects:
+ * 	The ring is emptied
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+VMMouseThreadReadInput(InputInfoPtr pInfo)
+{
+   MouseDevPtr pMse = pInfo->private;
+   VMMousePrivPtr mPriv = (VMMousePrivPtr)pMse->mousePriv;
+   VMMouseRing *ring = &mPriv->ring;
+   VMMOUSE_INPUT_DATA batch[VMMOUSE_DRAIN_PACKETS];
+   uint64_t count;
+
+   bool posted = false;
+   CARD32 delay;
+
+   /* EAGAIN only means the thread has not queued anything new. */
+   while (read(mPriv->wakeFd, &count, sizeof(count)) < 0 && errno == EINTR)
+      ;
+
+   for (;;) {
+      unsigned int tail = ring->tail;
+      unsigned int head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      unsigned int n = 0;
+
+      while (tail != head && n < VMMOUSE_DRAIN_PACKETS)
+	 batch[n++] = ring->packets[tail++ & (VMMOUSE_RING_SIZE - 1)];
+      if (n == 0)
+	 break;
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+      VMMousePostBatch(pInfo, batch, n);
+      posted = true;
+   }
+
+   /* Recovery runs here, on the server side, as without the thread. */
+   if (__atomic_load_n(&mPriv->threadError, __ATOMIC_ACQUIRE)) {
+      delay = VMMouseRecoverBegin(mPriv);
+      if (delay)
+	 mPriv->recoverTimer = TimerSet(mPriv->recoverTimer, 0, delay,
+					VMMouseRecoverTimer, pInfo);
+   } else if (posted) {
+      mPriv->recoverDelay = 0;
+   }
+}
+#endif
+
+
 /*
  *----------------------------------------------------------------------
  *
@@ -26,11 +26,24 @@
  */
 #include "config.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <signal.h>
+#include <unistd.h>
 #include "vmmouse_client.h"
+#include "vmmouse_hypervisor.h"
+#include "vmmouse_proto.h"
+#include "vmmouse_udev.h"
 
-extern int vmmouse_uses_kernel_driver(void);
+/*
+ * The cache holds a single line "<boot id> <kernel driver> <verdict>".
+ * It lives on /run so it never outlives the boot it describes; the boot
+ * id still guards against a /run that is not cleared on reboot.
+ */
+#define VMMOUSE_DETECT_CACHE "/run/vmmouse_detect.cache"
+#define VMMOUSE_BOOT_ID      "/proc/sys/kernel/random/boot_id"
+#define VMMOUSE_BOOT_ID_LEN  36
 
 void
 segvCB(int sig)
@@ -39,10 +52,117 @@ segvCB(int sig)
 }
 
 
-int
-main(void)
+static void
+printStats(void)
+{
+   VMMouseProtoStats protoStats;
+   VMMOUSE_CLIENT_STATS clientStats;
+   int i;
+
+   VMMouseProto_GetStats(&protoStats);
+   for (i = 0; i < VMMOUSE_PROTO_STAT_MAX; i++) {
+      if (protoStats.calls[i])
+         fprintf(stderr, "vmmouse_detect: %s: %llu calls, %llu cycles\n",
+                 VMMouseProto_StatName(i),
+                 (unsigned long long)protoStats.calls[i],
+                 (unsigned long long)protoStats.cycles[i]);
+   }
+
+   VMMouseClient_GetStats(&clientStats);
+   fprintf(stderr, "vmmouse_detect: %llu exits, %llu cycles\n",
+           (unsigned long long)clientStats.Exits,
+           (unsigned long long)clientStats.Cycles);
+   if (clientStats.WordsDiscarded)
+      fprintf(stderr, "vmmouse_detect: %llu queue words discarded on resync\n",
+              (unsigned long long)clientStats.WordsDiscarded);
+}
+
+
+#ifdef __linux__
+static int
+readBootId(char *bootId)
 {
-   if (vmmouse_uses_kernel_driver())
+   FILE *f = fopen(VMMOUSE_BOOT_ID, "r");
+   int ret;
+
+   if (!f)
+      return 0;
+   ret = fscanf(f, "%36s", bootId) == 1 &&
+      strlen(bootId) == VMMOUSE_BOOT_ID_LEN;
+   fclose(f);
+   return ret;
+}
+
+
+/*
+ * Returns the cached verdict (0 or 1), or -1 if the cache is missing or
+ * was written for another boot or kernel driver state.
+ */
+static int
+readCache(const char *bootId, int kernelDriver)
+{
+   char cachedId[VMMOUSE_BOOT_ID_LEN + 1];
+   int cachedKernel, verdict;
+   FILE *f = fopen(VMMOUSE_DETECT_CACHE, "r");
+   int ret = -1;
+
+   if (!f)
+      return -1;
+   if (fscanf(f, "%36s %d %d", cachedId, &cachedKernel, &verdict) == 3 &&
+       strcmp(cachedId, bootId) == 0 && cachedKernel == kernelDriver &&
+       (verdict == 0 || verdict == 1))
+      ret = verdict;
+   fclose(f);
+   return ret;
+}
+
+
+/*
+ * Writes the cache to a temporary file and renames it into place, so
+ * concurrent invocations from udev never see a partial line.
+ */
+static void
+writeCache(const char *bootId, int kernelDriver, int verdict)
+{
+   char tmp[] = VMMOUSE_DETECT_CACHE ".XXXXXX";
+   int fd = mkstemp(tmp);
+   FILE *f;
+
+   if (fd < 0)
+      return;
+   f = fdopen(fd, "w");
+   if (!f) {
+      close(fd);
+      unlink(tmp);
+      return;
+   }
+   fprintf(f, "%s %d %d\n", bootId, kernelDriver, verdict);
+   if (fclose(f) != 0 || rename(tmp, VMMOUSE_DETECT_CACHE) != 0)
+      unlink(tmp);
+}
+#endif
+
+
+static int
+detect(int verbose, int checkHypervisor, int otherHypervisors,
+       int kernelDriver)
+{
+   int ret;
+
+   /*
+    * Ask CPUID whether the backdoor may be there before raising the I/O
+    * privilege level and touching the port, see vmmouse_hypervisor.h.
+    */
+   if (checkHypervisor) {
+      VMMouseHypervisor hv = VMMouseHypervisor_Detect();
+
+      if (verbose)
+         fprintf(stderr, "vmmouse_detect: %s\n", VMMouseHypervisor_Name(hv));
+      if (!VMMouseHypervisor_MayHaveBackdoor(hv, otherHypervisors))
+         return 1;
+   }
+
+   if (kernelDriver)
       return 1;
 
    /*
@@ -55,14 +175,75 @@ main(void)
    (void) xf86EnableIO();
    if (VMMouseClient_Enable()) {
       VMMouseClient_Disable();
-      return 0;
+      ret = 0;
    } else {
       /*
        * We get here if we are running in a VM and the vmmouse
        * device is disabled.
        */
-      return 1;
+      ret = 1;
    }
+   if (verbose)
+      printStats();
+   return ret;
 #endif
    return 1;
 }
+
+
+int
+main(int argc, char **argv)
+{
+   int verbose = 0;
+   int checkHypervisor = 1;
+   int otherHypervisors = 0;
+   int useCache = 0;
+   int kernelDriver;
+   int opt;
+   int ret;
+
+   while ((opt = getopt(argc, argv, "cnov")) != -1) {
+      switch (opt) {
+      case 'c':
+         useCache = 1;
+         break;
+      case 'n':
+         checkHypervisor = 0;
+         break;
+      case 'o':
+         otherHypervisors = 1;
+         break;
+      case 'v':
+         verbose = 1;
+         break;
+      default:
+         fprintf(stderr, "usage: vmmouse_detect [-c] [-n] [-o] [-v]\n");
+         return 1;
+      }
+   }
+
+   kernelDriver = vmmouse_uses_kernel_driver();
+
+#ifdef __linux__
+   if (useCache) {
+      char bootId[VMMOUSE_BOOT_ID_LEN + 1];
+
+      if (readBootId(bootId)) {
+         ret = readCache(bootId, kernelDriver);
+         if (ret >= 0) {
+            if (verbose)
+               fprintf(stderr, "vmmouse_detect: cached verdict %d\n", ret);
+            return ret;
+         }
+         ret = detect(verbose, checkHypervisor, otherHypervisors,
+                      kernelDriver);
+         writeCache(bootId, kernelDriver, ret);
+         return ret;
+      }
+   }
+#else
+   (void) useCache;
+#endif
+
+   return detect(verbose, checkHypervisor, otherHypervisors, kernelDriver);
+}
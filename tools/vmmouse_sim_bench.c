@@ -0,0 +1,333 @@
+/*
+ * Copyright 2026 by the XLibre project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ */
+
+/*
+ * vmmouse_sim_bench.c --
+ *
+ *      Drains the simulated host through VMMouseClient_GetInputBatch, as
+ *      the driver does, and reports the backdoor requests and time spent
+ *      per packet for bursts of increasing size, with and without
+ *      high-bandwidth transfers. It also checks that every packet comes
+ *      out once and in order, that VMMOUSE_ERROR is reported and cleared
+ *      by a new enable, that a misaligned queue is resynchronised and
+ *      that coalescing keeps presses and releases where they happened,
+ *      so it doubles as the "make check" test of the client.
+ *
+ *      usage: vmmouse_sim_bench [-r rounds]
+ */
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmmouse_client.h"
+#include "vmmouse_proto.h"
+#include "vmmouse_sim.h"
+
+#define BENCH_QUEUE_WORDS   4096
+#define BENCH_BATCH         64
+
+static const unsigned int burstSizes[] = { 1, 4, 16, 64, 256, 1024 };
+
+static int failures;
+
+
+static void
+fail(const char *what)
+{
+   fprintf(stderr, "vmmouse_sim_bench: FAIL: %s\n", what);
+   failures++;
+}
+
+
+static uint64_t
+nowNsec(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static uint64_t
+exits(void)
+{
+   VMMOUSE_CLIENT_STATS stats;
+
+   VMMouseClient_GetStats(&stats);
+   return stats.Exits;
+}
+
+
+static void
+configure(bool bulk, unsigned int errorEvery)
+{
+   VMMouseSimConfig config = {
+      true,                /* present */
+      true,                /* deviceEnabled */
+      bulk,                /* bulk */
+      0,                   /* packetRate, packets are queued by hand */
+      BENCH_QUEUE_WORDS,   /* queueWords */
+      0,                   /* switchEvery */
+      errorEvery           /* errorEvery */
+   };
+
+   VMMouseSim_Configure(&config);
+   VMMouseClient_SetBulk(bulk);
+   if (!VMMouseClient_Enable())
+      fail("enable");
+}
+
+
+/*
+ * Queue burst packets numbered from seq and drain them all, checking
+ * that they come out in order.
+ */
+static unsigned int
+drainBurst(unsigned int seq, unsigned int burst)
+{
+   VMMOUSE_INPUT_DATA batch[BENCH_BATCH];
+   unsigned int expect = seq;
+   unsigned int n, i;
+
+   for (i = 0; i < burst; i++)
+      VMMouseSim_QueuePacket(VMMOUSE_MOVE_ABSOLUTE << 16, seq + i, 0, 0);
+
+   do {
+      n = VMMouseClient_GetInputBatch(batch, BENCH_BATCH);
+      if (n == VMMOUSE_ERROR) {
+         fail("unexpected VMMOUSE_ERROR");
+         break;
+      }
+      for (i = 0; i < n; i++, expect++) {
+         if (batch[i].X != (int)expect) {
+            fail("packet lost or out of order");
+            return burst;
+         }
+      }
+   } while (n == BENCH_BATCH);
+
+   if (expect != seq + burst)
+      fail("short drain");
+   return burst;
+}
+
+
+static void
+benchMode(const char *name, bool bulk, unsigned int rounds)
+{
+   unsigned int b, r;
+
+   for (b = 0; b < sizeof(burstSizes) / sizeof(burstSizes[0]); b++) {
+      unsigned int packets = 0;
+      uint64_t exits0, start, elapsed;
+
+      configure(bulk, 0);
+      exits0 = exits();
+      start = nowNsec();
+      for (r = 0; r < rounds; r++)
+         packets += drainBurst(packets, burstSizes[b]);
+      elapsed = nowNsec() - start;
+
+      printf("%-10s %6u %8u %12.2f %12.1f\n", name, burstSizes[b], packets,
+             (double)(exits() - exits0) / packets,
+             (double)elapsed / packets);
+   }
+}
+
+
+static void
+checkError(void)
+{
+   VMMOUSE_INPUT_DATA batch[BENCH_BATCH];
+   unsigned int n = 0;
+   int i;
+
+   /* Every 4th status query fails. */
+   configure(false, 4);
+   for (i = 0; i < 4; i++) {
+      n = VMMouseClient_GetInputBatch(batch, BENCH_BATCH);
+      if (n == VMMOUSE_ERROR)
+         break;
+   }
+   if (n != VMMOUSE_ERROR) {
+      fail("VMMOUSE_ERROR not reported");
+      return;
+   }
+   if (!VMMouseClient_Enable())
+      fail("enable after VMMOUSE_ERROR");
+   else if (VMMouseClient_GetInputBatch(batch, BENCH_BATCH) == VMMOUSE_ERROR)
+      fail("VMMOUSE_ERROR not cleared by enable");
+}
+
+
+static void
+checkResyncAt(const char *where, bool atHead)
+{
+   static const uint32_t stray[] = { 0xdead };
+   VMMOUSE_INPUT_DATA batch[BENCH_BATCH];
+   VMMOUSE_CLIENT_STATS before, after;
+   VMMouseProtoCmd cmd;
+   char what[64];
+   unsigned int n;
+   uint32_t queued = atHead ? 7 : 9;
+
+   configure(false, 0);
+   VMMouseSim_QueuePacket(VMMOUSE_MOVE_ABSOLUTE << 16, 1, 0, 0);
+   VMMouseSim_QueuePacket(VMMOUSE_MOVE_ABSOLUTE << 16, 2, 0, 0);
+
+   if (atHead) {
+      /* Leave the rest of the first packet at the head of the queue. */
+      cmd.in.vEbx = 1;
+      cmd.in.command = VMMOUSE_PROTO_CMD_ABSPOINTER_DATA;
+      VMMouseProto_SendCmd(&cmd);
+   } else {
+      /* Start a packet the host never finishes. */
+      VMMouseSim_QueueWords(stray, 1);
+   }
+
+   VMMouseClient_GetStats(&before);
+   n = VMMouseClient_GetInputBatch(batch, BENCH_BATCH);
+   VMMouseClient_GetStats(&after);
+   snprintf(what, sizeof(what), "misaligned packets decoded (%s)", where);
+   if (n != 0)
+      fail(what);
+   snprintf(what, sizeof(what), "discarded words not counted (%s)", where);
+   if (after.WordsDiscarded - before.WordsDiscarded != queued ||
+       VMMouseClient_TakeDiscarded() != queued)
+      fail(what);
+
+   /* Packets queued after the resync start on a boundary. */
+   VMMouseSim_QueuePacket(VMMOUSE_MOVE_ABSOLUTE << 16, 3, 0, 0);
+   n = VMMouseClient_GetInputBatch(batch, BENCH_BATCH);
+   snprintf(what, sizeof(what), "no packet after resync (%s)", where);
+   if (n != 1 || batch[0].X != 3)
+      fail(what);
+}
+
+
+static void
+checkResync(void)
+{
+   checkResyncAt("head", true);
+   checkResyncAt("tail", false);
+}
+
+static void
+checkCoalesce(void)
+{
+   /* Press at 1, drag to 3, release at 4, move on to 6. */
+   static const struct {
+      unsigned short buttons;
+      int x;
+   } in[] = {
+      { 0, 0 },
+      { VMMOUSE_LEFT_BUTTON, 1 },
+      { VMMOUSE_LEFT_BUTTON, 2 },
+      { VMMOUSE_LEFT_BUTTON, 3 },
+      { 0, 4 },
+      { 0, 5 },
+      { 0, 6 },
+   };
+   static const struct {
+      unsigned short buttons;
+      int x;
+   } want[] = {
+      { 0, 0 },
+      { VMMOUSE_LEFT_BUTTON, 1 },
+      { VMMOUSE_LEFT_BUTTON, 3 },
+      { 0, 4 },
+      { 0, 6 },
+   };
+   const unsigned int numIn = sizeof(in) / sizeof(in[0]);
+   const unsigned int numWant = sizeof(want) / sizeof(want[0]);
+   VMMOUSE_INPUT_DATA batch[BENCH_BATCH];
+   unsigned int i, n;
+
+   configure(false, 0);
+   for (i = 0; i < numIn; i++)
+      VMMouseSim_QueuePacket(VMMOUSE_MOVE_ABSOLUTE << 16 | in[i].buttons,
+                             in[i].x, 0, 0);
+
+   n = VMMouseClient_GetInputBatch(batch, BENCH_BATCH);
+   if (n != numIn) {
+      fail("drag packets not read");
+      return;
+   }
+   n = VMMouseClient_Coalesce(batch, n);
+   if (n != numWant) {
+      fail("drag coalesced to the wrong number of packets");
+      return;
+   }
+   for (i = 0; i < n; i++) {
+      if (batch[i].Buttons != want[i].buttons || batch[i].X != want[i].x) {
+         fail("button transition moved by coalescing");
+         return;
+      }
+   }
+}
+
+
+int
+main(int argc, char **argv)
+{
+   unsigned int rounds = 64;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "r:")) != -1) {
+      switch (opt) {
+      case 'r':
+         rounds = strtoul(optarg, NULL, 0);
+         break;
+      default:
+         fprintf(stderr, "usage: vmmouse_sim_bench [-r rounds]\n");
+         return 1;
+      }
+   }
+   if (rounds < 1)
+      rounds = 1;
+
+   if (!VMMouseProto_SetTransport("sim")) {
+      fail("no sim transport");
+      return 1;
+   }
+
+   printf("%-10s %6s %8s %12s %12s\n", "mode", "burst", "packets",
+          "exits/pkt", "ns/pkt");
+   benchMode("per-packet", false, rounds);
+   benchMode("bulk", true, rounds);
+
+   checkError();
+   checkResync();
+   checkCoalesce();
+
+   VMMouseSim_Shutdown();
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,532 @@
+/*
+ * Copyright 2026 by the XLibre project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ */
+
+/*
+ * vmmouse_trap.c --
+ *
+ *      Trap-and-emulate harness. Runs an unmodified program (vmmouse_detect,
+ *      or an X server loading vmmouse_drv.so) under ptrace with I/O port
+ *      access denied. The resulting faults on the backdoor port accesses
+ *      are decoded from the register file and answered by the simulated
+ *      VMMouse host, so the production instruction sequence, including
+ *      the VMMouseProtoCmd register marshalling, runs end to end on a
+ *      machine that is not a VMware virtual machine.
+ */
+#define _GNU_SOURCE     /* process_vm_writev */
+#include "config.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/uio.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+
+#include "vmmouse_proto.h"
+#include "vmmouse_sim.h"
+
+#ifndef CAP_SYS_RAWIO
+#define CAP_SYS_RAWIO 17
+#endif
+
+#ifdef __x86_64__
+#define REG_AX(r) (r).rax
+#define REG_BX(r) (r).rbx
+#define REG_CX(r) (r).rcx
+#define REG_DX(r) (r).rdx
+#define REG_SI(r) (r).rsi
+#define REG_DI(r) (r).rdi
+#define REG_IP(r) (r).rip
+#else
+#define REG_AX(r) (r).eax
+#define REG_BX(r) (r).ebx
+#define REG_CX(r) (r).ecx
+#define REG_DX(r) (r).edx
+#define REG_SI(r) (r).esi
+#define REG_DI(r) (r).edi
+#define REG_IP(r) (r).eip
+#endif
+
+#define OPCODE_INL_DX     0xed
+#define OPCODE_REP        0xf3
+#define OPCODE_INSL       0x6d
+
+#define TRAP_MAX_WORDS    0x10000
+
+static unsigned long trapCount[256];
+static unsigned long trapBulk;
+static unsigned long trapBulkWords;
+static uint64_t trapNsec;
+static uint32_t trapBuf[TRAP_MAX_WORDS];
+
+/*
+ * Tasks being traced. A task created by a traced clone or fork starts
+ * with a SIGSTOP from ptrace itself; attachPending is set until that
+ * stop has been seen, which may be before or after the parent's event.
+ */
+typedef struct {
+   pid_t pid;
+   bool attachPending;
+} TrapTask;
+
+static TrapTask *trapTasks;
+static unsigned int trapNumTasks;
+static unsigned int trapMaxTasks;
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TrapNow --
+ *
+ *      Read the monotonic clock.
+ *
+ * Results:
+ *      The current time in nanoseconds.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static uint64_t
+TrapNow(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TrapEmulateInOut --
+ *
+ *      Emulate "inl %dx, %eax" on the low-bandwidth backdoor port.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      The tracee register file is updated with the host reply.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+TrapEmulateInOut(struct user_regs_struct *regs)
+{
+   VMMouseProtoCmd cmd;
+
+   memset(&cmd, 0, sizeof(cmd));
+   cmd.in.vEax = REG_AX(*regs);
+   cmd.in.vEbx = REG_BX(*regs);
+   cmd.in.vEcx = REG_CX(*regs);
+   cmd.in.vEdx = REG_DX(*regs);
+   cmd.in.vEsi = REG_SI(*regs);
+   cmd.in.vEdi = REG_DI(*regs);
+
+   trapCount[cmd.in.command & 0xff]++;
+   VMMouseSim_SendCmd(&cmd);
+
+   REG_AX(*regs) = cmd.out.vEax;
+   REG_BX(*regs) = cmd.out.vEbx;
+   REG_CX(*regs) = cmd.out.vEcx;
+   REG_DX(*regs) = cmd.out.vEdx;
+   REG_SI(*regs) = cmd.out.vEsi;
+   REG_DI(*regs) = cmd.out.vEdi;
+   REG_IP(*regs) += 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TrapEmulateInsl --
+ *
+ *      Emulate "rep insl" on the high-bandwidth backdoor port.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      On success the data is written to the tracee buffer at edi,
+ *      which is advanced like the string instruction would.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+TrapEmulateInsl(pid_t pid, struct user_regs_struct *regs)
+{
+   uint32_t numWords = REG_CX(*regs);
+   uint16_t command = REG_BX(*regs);
+   struct iovec local, remote;
+
+   trapBulk++;
+   REG_IP(*regs) += 2;
+   REG_BX(*regs) = 0;
+
+   if (numWords > TRAP_MAX_WORDS ||
+       !VMMouseSim_ReadBulk(command, trapBuf, numWords)) {
+      return;
+   }
+
+   local.iov_base = trapBuf;
+   local.iov_len = numWords * sizeof(uint32_t);
+   remote.iov_base = (void *)(uintptr_t)REG_DI(*regs);
+   remote.iov_len = local.iov_len;
+   if (process_vm_writev(pid, &local, 1, &remote, 1, 0) !=
+       (ssize_t)local.iov_len) {
+      perror("vmmouse_trap: process_vm_writev");
+      return;
+   }
+
+   trapBulkWords += numWords;
+   REG_DI(*regs) += local.iov_len;
+   REG_CX(*regs) = 0;
+   REG_BX(*regs) = VMMOUSE_PROTO_HB_STATUS_SUCCESS;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TrapHandleFault --
+ *
+ *      Decode the faulting instruction of a tracee that got SIGSEGV and
+ *      emulate it if it is a backdoor access.
+ *
+ * Results:
+ *      1 if the fault was emulated, 0 if the signal must be delivered.
+ *
+ * Side effects:
+ *      See TrapEmulateInOut and TrapEmulateInsl.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static int
+TrapHandleFault(pid_t pid)
+{
+   struct user_regs_struct regs;
+   unsigned char insn[sizeof(long)];
+   uint16_t port;
+   uint64_t start = TrapNow();
+   long word;
+
+   if (ptrace(PTRACE_GETREGS, pid, NULL, &regs) == -1) {
+      return 0;
+   }
+
+   errno = 0;
+   word = ptrace(PTRACE_PEEKTEXT, pid, (void *)(uintptr_t)REG_IP(regs), NULL);
+   if (errno) {
+      return 0;
+   }
+   memcpy(insn, &word, sizeof(insn));
+
+   if ((uint32_t)REG_AX(regs) != VMMOUSE_PROTO_MAGIC) {
+      return 0;
+   }
+
+   port = REG_DX(regs) & 0xffff;
+   if (insn[0] == OPCODE_INL_DX && port == VMMOUSE_PROTO_PORT) {
+      TrapEmulateInOut(&regs);
+   } else if (insn[0] == OPCODE_REP && insn[1] == OPCODE_INSL &&
+              port == VMMOUSE_PROTO_HB_PORT) {
+      TrapEmulateInsl(pid, &regs);
+   } else {
+      return 0;
+   }
+
+   if (ptrace(PTRACE_SETREGS, pid, NULL, &regs) == -1) {
+      return 0;
+   }
+
+   trapNsec += TrapNow() - start;
+   return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TrapFindTask / TrapAddTask / TrapRemoveTask --
+ *
+ *      Look up, start or stop tracking a traced task.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static TrapTask *
+TrapFindTask(pid_t pid)
+{
+   unsigned int i;
+
+   for (i = 0; i < trapNumTasks; i++) {
+      if (trapTasks[i].pid == pid) {
+         return &trapTasks[i];
+      }
+   }
+   return NULL;
+}
+
+static TrapTask *
+TrapAddTask(pid_t pid, bool attachPending)
+{
+   TrapTask *task;
+
+   if (trapNumTasks == trapMaxTasks) {
+      unsigned int max = trapMaxTasks ? trapMaxTasks * 2 : 16;
+
+      task = realloc(trapTasks, max * sizeof(*task));
+      if (!task) {
+         perror("vmmouse_trap: realloc");
+         exit(1);
+      }
+      trapTasks = task;
+      trapMaxTasks = max;
+   }
+   task = &trapTasks[trapNumTasks++];
+   task->pid = pid;
+   task->attachPending = attachPending;
+   return task;
+}
+
+static void
+TrapRemoveTask(pid_t pid)
+{
+   TrapTask *task = TrapFindTask(pid);
+
+   if (task) {
+      *task = trapTasks[--trapNumTasks];
+   }
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TrapStopSignal --
+ *
+ *      Decide what to do with a tracee that stopped. Only the stops
+ *      that ptrace itself causes are swallowed: event stops, the
+ *      attach SIGSTOP of a new task and group-stops (which
+ *      PTRACE_GETSIGINFO reports with EINVAL). Backdoor faults are
+ *      emulated. Every other signal is delivered, including SIGSTOP
+ *      and SIGTRAP sent by job control, a debugger or raise().
+ *
+ * Results:
+ *      The signal to deliver when the tracee is resumed, or 0.
+ *
+ * Side effects:
+ *      The task list is updated.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static int
+TrapStopSignal(pid_t pid, int status)
+{
+   int event = status >> 16;
+   int sig = WSTOPSIG(status);
+   TrapTask *task;
+   siginfo_t si;
+
+   if (event) {
+      if (event == PTRACE_EVENT_CLONE || event == PTRACE_EVENT_FORK ||
+          event == PTRACE_EVENT_VFORK) {
+         unsigned long msg;
+
+         if (ptrace(PTRACE_GETEVENTMSG, pid, NULL, &msg) == 0 &&
+             !TrapFindTask((pid_t)msg)) {
+            TrapAddTask((pid_t)msg, true);
+         }
+      }
+      return 0;
+   }
+
+   task = TrapFindTask(pid);
+   if (!task) {
+      /* A new task whose attach stop beat its parent's event. */
+      TrapAddTask(pid, false);
+      return sig == SIGSTOP ? 0 : sig;
+   }
+   if (task->attachPending && sig == SIGSTOP) {
+      task->attachPending = false;
+      return 0;
+   }
+
+   if (ptrace(PTRACE_GETSIGINFO, pid, NULL, &si) == -1) {
+      return errno == EINVAL ? 0 : sig;
+   }
+   if (sig == SIGSEGV && TrapHandleFault(pid)) {
+      return 0;
+   }
+   return sig;
+}
+
+
+/*
+ *----------------------------------------------------------------------------
+ *
+ * TrapReport --
+ *
+ *      Print the trapped backdoor accesses.
+ *
+ *----------------------------------------------------------------------------
+ */
+
+static void
+TrapReport(void)
+{
+   VMMouseSimStats stats;
+   unsigned long total = trapBulk;
+   int i;
+
+   for (i = 0; i < 256; i++) {
+      if (trapCount[i]) {
+         fprintf(stderr, "vmmouse_trap: command %3d: %lu exits\n", i,
+                 trapCount[i]);
+         total += trapCount[i];
+      }
+   }
+   fprintf(stderr, "vmmouse_trap: bulk: %lu exits, %lu words\n",
+           trapBulk, trapBulkWords);
+
+   VMMouseSim_GetStats(&stats);
+   fprintf(stderr, "vmmouse_trap: host: %lu packets queued, %lu dropped, "
+           "%lu errors injected\n", stats.packetsQueued,
+           stats.packetsDropped, stats.errorsInjected);
+   if (total) {
+      fprintf(stderr, "vmmouse_trap: %lu exits, %llu ns per exit in tracer\n",
+              total, (unsigned long long)(trapNsec / total));
+   }
+}
+
+
+static void
+usage(void)
+{
+   fprintf(stderr, "usage: vmmouse_trap [-s simhost] program [args...]\n");
+   exit(2);
+}
+
+
+int
+main(int argc, char **argv)
+{
+   const char *spec = "";
+   pid_t child, pid;
+   int status, opt;
+   int ret = 1;
+
+   while ((opt = getopt(argc, argv, "+s:")) != -1) {
+      switch (opt) {
+      case 's':
+         spec = optarg;
+         break;
+      default:
+         usage();
+      }
+   }
+   if (optind >= argc) {
+      usage();
+   }
+   if (!VMMouseSim_ConfigureFromString(spec)) {
+      fprintf(stderr, "vmmouse_trap: invalid simulated host \"%s\"\n", spec);
+      return 2;
+   }
+
+   child = fork();
+   if (child == -1) {
+      perror("vmmouse_trap: fork");
+      return 1;
+   }
+   if (child == 0) {
+      /*
+       * Make sure port access faults even when run as root: without
+       * CAP_SYS_RAWIO the program can't raise its I/O privilege.
+       */
+      (void) prctl(PR_CAPBSET_DROP, CAP_SYS_RAWIO, 0, 0, 0);
+      if (ptrace(PTRACE_TRACEME, 0, NULL, NULL) == -1) {
+         perror("vmmouse_trap: PTRACE_TRACEME");
+         _exit(127);
+      }
+      execvp(argv[optind], &argv[optind]);
+      perror("vmmouse_trap: exec");
+      _exit(127);
+   }
+
+   /* The first stop is the exec of the traced program. */
+   if (waitpid(child, &status, 0) == -1 || !WIFSTOPPED(status)) {
+      fprintf(stderr, "vmmouse_trap: failed to start %s\n", argv[optind]);
+      return 1;
+   }
+   /*
+    * Report execs as events rather than a bare SIGTRAP, so that a
+    * SIGTRAP stop is always a real signal.
+    */
+   ptrace(PTRACE_SETOPTIONS, child, NULL,
+          (void *)(PTRACE_O_EXITKILL | PTRACE_O_TRACESYSGOOD |
+                   PTRACE_O_TRACEEXEC | PTRACE_O_TRACECLONE |
+                   PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK));
+   TrapAddTask(child, false);
+   ptrace(PTRACE_CONT, child, NULL, NULL);
+
+   while ((pid = waitpid(-1, &status, __WALL)) != -1) {
+      int sig;
+
+      if (WIFEXITED(status) || WIFSIGNALED(status)) {
+         TrapRemoveTask(pid);
+         if (pid == child) {
+            ret = WIFEXITED(status) ? WEXITSTATUS(status) :
+                                      128 + WTERMSIG(status);
+            break;
+         }
+         continue;
+      }
+      if (!WIFSTOPPED(status)) {
+         continue;
+      }
+
+      sig = TrapStopSignal(pid, status);
+      ptrace(PTRACE_CONT, pid, NULL, (void *)(uintptr_t)sig);
+   }
+
+   TrapReport();
+   VMMouseSim_Shutdown();
+   return ret;
+}
@@ -25,73 +25,78 @@
  * authorization from the copyright holder(s) and author(s).
  */
 #include "config.h"
+#include "vmmouse_udev.h"
 
-#ifdef HAVE_LIBUDEV
-#include <libudev.h>
-#include <stdlib.h>
+#ifdef __linux__
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <string.h>
+#include <strings.h>
+#include <unistd.h>
 
 #define KERNEL_DEVNAME "VirtualPS/2 VMware VMMouse"
+#define SYSFS_INPUT_CLASS "/sys/class/input"
 
 /**
- * vmmouse_uses_kernel_driver - Check whether there's an active
- *    vmmouse driver in the kernel.
+ * vmmouse_kernel_driver_in - Look for the kernel vmmouse device in an
+ *    input class directory.
  *
  * Returns 0 if there was no kernel driver found.
  * Returns non-zero on error or if there was an active driver found.
  *
- * Scans the input subsystem for devices matching KERNEL_DEVNAME. These
- * devices are assumed to be active vmmouse drivers.
+ * Only the inputN entries carry a name attribute of their own; the
+ * eventN and mouseN nodes below them are skipped. The walk stops at
+ * the first device named KERNEL_DEVNAME.
  */
-int vmmouse_uses_kernel_driver(void)
+int vmmouse_kernel_driver_in(const char *classdir)
 {
-    struct udev *udev;
-    struct udev_enumerate *enumerate;
-    struct udev_list_entry *devices, *dev_list_entry;
-    struct udev_device *dev;
+    DIR *dir;
+    struct dirent *ent;
+    char path[PATH_MAX];
+    char name[sizeof(KERNEL_DEVNAME) + 1];
+    int found = 0;
 
-    udev = udev_new();
-    if (!udev)
+    dir = opendir(classdir);
+    if (!dir)
 	return 1;
 
-    /*
-     * Udev error return codes that are not caught immediately are
-     * typically caught in the input argument check in the udev
-     * function calls following the failing call!
-     */
-    enumerate = udev_enumerate_new(udev);
-    if (udev_enumerate_add_match_subsystem(enumerate, "input"))
-	goto out_err;
-    if (udev_enumerate_scan_devices(enumerate))
-	goto out_err;
+    while (!found && (ent = readdir(dir))) {
+	ssize_t len;
+	int fd;
 
-    devices = udev_enumerate_get_list_entry(enumerate);
-    udev_list_entry_foreach(dev_list_entry, devices) {
-	const char *path, *name;
+	if (strncmp(ent->d_name, "input", 5))
+	    continue;
 
-	path = udev_list_entry_get_name(dev_list_entry);
-	dev = udev_device_new_from_syspath(udev, path);
-	if (!dev)
-	    goto out_err;
-	name = udev_device_get_sysattr_value(dev, "name");
-	if (name && !strcasecmp(name, KERNEL_DEVNAME))
-	    goto out_found;
+	snprintf(path, sizeof(path), "%s/%s/name", classdir, ent->d_name);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	    continue;
+	len = read(fd, name, sizeof(name) - 1);
+	close(fd);
+	if (len <= 0)
+	    continue;
 
-	udev_device_unref(dev);
+	name[len] = '\0';
+	name[strcspn(name, "\n")] = '\0';
+	found = !strcasecmp(name, KERNEL_DEVNAME);
     }
 
-    udev_enumerate_unref(enumerate);
-    udev_unref(udev);
-
-    return 0;
-
-  out_found:
-    udev_device_unref(dev);
-  out_err:
-    udev_enumerate_unref(enumerate);
-    udev_unref(udev);
+    closedir(dir);
+    return found;
+}
 
-    return 1;
+/**
+ * vmmouse_uses_kernel_driver - Check whether there's an active
+ *    vmmouse driver in the kernel.
+ *
+ * Returns 0 if there was no kernel driver found.
+ * Returns non-zero on error or if there was an active driver found.
+ */
+int vmmouse_uses_kernel_driver(void)
+{
+    return vmmouse_kernel_driver_in(SYSFS_INPUT_CLASS);
 }
 #else
 int vmmouse_uses_kernel_driver(void)
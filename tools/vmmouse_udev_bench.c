@@ -0,0 +1,349 @@
+/*
+ * Copyright 2026 by the XLibre project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE COPYRIGHT HOLDER(S) OR AUTHOR(S) BE LIABLE FOR ANY CLAIM, DAMAGES OR
+ * OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE,
+ * ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+ * OTHER DEALINGS IN THE SOFTWARE.
+ *
+ * Except as contained in this notice, the name of the copyright holder(s)
+ * and author(s) shall not be used in advertising or otherwise to promote
+ * the sale, use or other dealings in this Software without prior written
+ * authorization from the copyright holder(s) and author(s).
+ */
+
+/*
+ * vmmouse_udev_bench.c --
+ *
+ *      Times vmmouse_kernel_driver_in() against fake sysfs input class
+ *      directories with a growing number of devices, next to a model of
+ *      the libudev enumeration it replaced. Each tree holds inputN
+ *      entries with name and uevent files like the kernel's, plus an
+ *      eventN entry per device with only a uevent file. The vmmouse
+ *      device, when present, is the last one created.
+ *
+ *      The model does what udev_enumerate_scan_devices() and the loop
+ *      over its list did: collect and sort every entry of the class
+ *      directory, then for each one allocate a device, check its uevent
+ *      file and read its name attribute. It is not libudev: libudev
+ *      does more work per device (uevent parsing, property lists), so
+ *      the numbers only compare the lookup with this model and give a
+ *      lower bound for the old cost, not a measurement of it.
+ *
+ *      usage: vmmouse_udev_bench [-i iterations] [-k]
+ *         -k  include the kernel vmmouse device in each tree
+ */
+#include "config.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vmmouse_udev.h"
+
+#define KERNEL_DEVNAME "VirtualPS/2 VMware VMMouse"
+
+static const int deviceCounts[] = { 8, 32, 128, 512, 2048 };
+
+static char root[] = "/tmp/vmmouse_udev_bench.XXXXXX";
+
+typedef struct {
+   char *syspath;
+   char *name;
+} BenchDevice;
+
+
+static int makePath(char *path, const char *fmt, ...)
+   __attribute__((format(printf, 2, 3)));
+
+static int
+makePath(char *path, const char *fmt, ...)
+{
+   va_list ap;
+   int len;
+
+   va_start(ap, fmt);
+   len = vsnprintf(path, PATH_MAX, fmt, ap);
+   va_end(ap);
+   if (len < 0 || len >= PATH_MAX) {
+      fprintf(stderr, "path too long\n");
+      return -1;
+   }
+   return 0;
+}
+
+
+static int
+writeFile(const char *path, const char *contents)
+{
+   FILE *f = fopen(path, "w");
+
+   if (!f) {
+      perror(path);
+      return -1;
+   }
+   fputs(contents, f);
+   fclose(f);
+   return 0;
+}
+
+
+static int
+makeDevice(const char *dir, const char *kind, int i, const char *name)
+{
+   char path[PATH_MAX];
+   char uevent[64];
+
+   if (makePath(path, "%s/%s%d", dir, kind, i))
+      return -1;
+   if (mkdir(path, 0755)) {
+      perror(path);
+      return -1;
+   }
+   snprintf(uevent, sizeof(uevent), "DEVNAME=input/%s%d\n", kind, i);
+   if (makePath(path, "%s/%s%d/uevent", dir, kind, i) ||
+       writeFile(path, uevent))
+      return -1;
+   if (name &&
+       (makePath(path, "%s/%s%d/name", dir, kind, i) ||
+        writeFile(path, name)))
+      return -1;
+   return 0;
+}
+
+
+static int
+makeTree(const char *dir, int numDevices, int withVMMouse)
+{
+   char name[64];
+   int i;
+
+   if (mkdir(dir, 0755)) {
+      perror(dir);
+      return -1;
+   }
+
+   for (i = 0; i < numDevices; i++) {
+      if (withVMMouse && i == numDevices - 1)
+         snprintf(name, sizeof(name), "%s\n", KERNEL_DEVNAME);
+      else
+         snprintf(name, sizeof(name), "Virtual input device %d\n", i);
+      if (makeDevice(dir, "input", i, name) ||
+          makeDevice(dir, "event", i, NULL))
+         return -1;
+   }
+   return 0;
+}
+
+
+static void
+removeTree(const char *dir, int numDevices)
+{
+   char path[PATH_MAX];
+   int i;
+
+   for (i = 0; i < numDevices; i++) {
+      if (!makePath(path, "%s/input%d/name", dir, i))
+         unlink(path);
+      if (!makePath(path, "%s/input%d/uevent", dir, i))
+         unlink(path);
+      if (!makePath(path, "%s/input%d", dir, i))
+         rmdir(path);
+      if (!makePath(path, "%s/event%d/uevent", dir, i))
+         unlink(path);
+      if (!makePath(path, "%s/event%d", dir, i))
+         rmdir(path);
+   }
+   rmdir(dir);
+}
+
+
+static char *
+readAttr(const char *syspath, const char *attr)
+{
+   char path[PATH_MAX];
+   char value[256];
+   ssize_t len;
+   int fd;
+
+   if (makePath(path, "%s/%s", syspath, attr))
+      return NULL;
+   fd = open(path, O_RDONLY | O_CLOEXEC);
+   if (fd < 0)
+      return NULL;
+   len = read(fd, value, sizeof(value) - 1);
+   close(fd);
+   if (len < 0)
+      return NULL;
+   value[len] = '\0';
+   value[strcspn(value, "\n")] = '\0';
+   return strdup(value);
+}
+
+
+static int
+compareNames(const void *a, const void *b)
+{
+   return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+
+/*
+ * The libudev model: enumerate and sort everything, then instantiate
+ * each device in turn until one carries the vmmouse name.
+ */
+static int
+enumerateAll(const char *classdir)
+{
+   DIR *dir;
+   struct dirent *ent;
+   char **paths = NULL;
+   size_t numPaths = 0, maxPaths = 0, i;
+   char path[PATH_MAX];
+   int found = 0;
+
+   dir = opendir(classdir);
+   if (!dir)
+      return 1;
+   while ((ent = readdir(dir))) {
+      if (ent->d_name[0] == '.')
+         continue;
+      if (makePath(path, "%s/%s", classdir, ent->d_name))
+         continue;
+      if (numPaths == maxPaths) {
+         char **grown;
+
+         maxPaths = maxPaths ? maxPaths * 2 : 64;
+         grown = realloc(paths, maxPaths * sizeof(*paths));
+         if (!grown)
+            break;
+         paths = grown;
+      }
+      paths[numPaths++] = strdup(path);
+   }
+   closedir(dir);
+   qsort(paths, numPaths, sizeof(*paths), compareNames);
+
+   for (i = 0; i < numPaths && !found; i++) {
+      BenchDevice *dev;
+      char *uevent;
+
+      uevent = readAttr(paths[i], "uevent");
+      if (!uevent)
+         continue;
+      dev = calloc(1, sizeof(*dev));
+      if (!dev) {
+         free(uevent);
+         break;
+      }
+      dev->syspath = strdup(paths[i]);
+      dev->name = readAttr(paths[i], "name");
+      found = dev->name && !strcasecmp(dev->name, KERNEL_DEVNAME);
+      free(dev->name);
+      free(dev->syspath);
+      free(dev);
+      free(uevent);
+   }
+
+   for (i = 0; i < numPaths; i++)
+      free(paths[i]);
+   free(paths);
+   return found;
+}
+
+
+static double
+nowUsec(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+
+int
+main(int argc, char **argv)
+{
+   int iterations = 200;
+   int withVMMouse = 0;
+   unsigned int n;
+   int opt;
+
+   while ((opt = getopt(argc, argv, "i:k")) != -1) {
+      switch (opt) {
+      case 'i':
+         iterations = atoi(optarg);
+         break;
+      case 'k':
+         withVMMouse = 1;
+         break;
+      default:
+         fprintf(stderr, "usage: vmmouse_udev_bench [-i iterations] [-k]\n");
+         return 1;
+      }
+   }
+   if (iterations < 1)
+      iterations = 1;
+
+   if (!mkdtemp(root)) {
+      perror("mkdtemp");
+      return 1;
+   }
+
+   printf("%8s %12s %12s %8s\n", "devices", "usec/sysfs", "usec/model",
+          "found");
+   for (n = 0; n < sizeof(deviceCounts) / sizeof(deviceCounts[0]); n++) {
+      char dir[PATH_MAX];
+      double start, sysfsUsec, modelUsec;
+      int found = 0, enumFound = 0;
+      int i;
+
+      if (makePath(dir, "%s/%d", root, deviceCounts[n]))
+         break;
+      if (makeTree(dir, deviceCounts[n], withVMMouse)) {
+         removeTree(dir, deviceCounts[n]);
+         rmdir(root);
+         return 1;
+      }
+
+      start = nowUsec();
+      for (i = 0; i < iterations; i++)
+         found = vmmouse_kernel_driver_in(dir);
+      sysfsUsec = (nowUsec() - start) / iterations;
+
+      start = nowUsec();
+      for (i = 0; i < iterations; i++)
+         enumFound = enumerateAll(dir);
+      modelUsec = (nowUsec() - start) / iterations;
+
+      printf("%8d %12.1f %12.1f %8s\n", deviceCounts[n], sysfsUsec,
+             modelUsec,
+             found == enumFound ? (found ? "yes" : "no") : "differ");
+      removeTree(dir, deviceCounts[n]);
+   }
+
+   rmdir(root);
+   return 0;
+}